@@ -29,6 +29,7 @@ def main():
     parser.add_argument("--do-build", action="store_true")
     parser.add_argument("--do-image", action="store_true")
     parser.add_argument("--do-run", action="store_true")
+    parser.add_argument("--do-test", action="store_true")
     parser.add_argument("--clean", action="store_true")
 
     args = parser.parse_args()
@@ -36,8 +37,9 @@ def main():
     do_build = args.do_build
     do_image = args.do_image
     do_run   = args.do_run
+    do_test  = args.do_test
 
-    if not (do_build or do_image or do_run):
+    if not (do_build or do_image or do_run or do_test):
         do_build = True
         do_image = True
         do_run   = True
@@ -49,9 +51,9 @@ def main():
         sys.exit(1)
 
     if args.mode == "debug":
-        cflags = ["-std=c11", "-O0", "-g", "-Wall", "-Wextra"]
+        cflags = ["-std=c11", "-O0", "-g", "-Wall", "-Wextra", "-pthread"]
     else:
-        cflags = ["-std=c11", "-O2", "-DNDEBUG", "-Wall", "-Wextra"]
+        cflags = ["-std=c11", "-O2", "-DNDEBUG", "-Wall", "-Wextra", "-pthread"]
 
     if do_image:
         print(f"[image] creating {args.img} (size={args.size})")
@@ -98,16 +100,20 @@ def main():
             print()
             f.write("\n")
 
+    if do_test:
+        # Behaviour checks run on a small image of their own, so the disk full case is quick.
+        print(f"[test] gcc {args.mode}")
+        run(["gcc", *cflags, "-Iinclude", os.path.join("tests", "fs_test.c"), *src_files, "-o", "fs_test.bin"])
+        run(["python3", "fat_builder.py", "--size", "4MiB", "--output", "test.img", "--init-root-dir"])
+        run(["./fs_test.bin", "test.img", "test.img.sc"])
+
     if args.clean:
-        print(f"[clean] removing bench.bin and {args.img}")
-        try:
-            os.remove("bench.bin")
-        except FileNotFoundError:
-            pass
-        try:
-            os.remove(args.img)
-        except FileNotFoundError:
-            pass
+        print(f"[clean] removing bench.bin, fs_test.bin and images")
+        for path in ["bench.bin", "fs_test.bin", args.img, "test.img", "test.img.sc"]:
+            try:
+                os.remove(path)
+            except FileNotFoundError:
+                pass
 
 if __name__ == "__main__":
     main()
\ No newline at end of file
@@ -6,7 +6,8 @@ set -euo pipefail
 #   DO_BUILD=1 ./build.sh      # only build
 #   DO_IMAGE=1 ./build.sh      # only create image
 #   DO_RUN=1   ./build.sh      # only run
-#   CLEAN=1    ./build.sh      # remove bench.bin and image after run
+#   DO_TEST=1  ./build.sh      # only build and run the behaviour tests
+#   CLEAN=1    ./build.sh      # remove binaries and images after run
 #
 # Env vars:
 #   IMG=image.img
@@ -21,7 +22,7 @@ ITERS="${ITERS:-100}"
 MODE="${MODE:-release}"
 OUT="${OUT:-results.txt}"
 
-if [[ "${DO_BUILD:-}" != "1" && "${DO_IMAGE:-}" != "1" && "${DO_RUN:-}" != "1" ]]; then
+if [[ "${DO_BUILD:-}" != "1" && "${DO_IMAGE:-}" != "1" && "${DO_RUN:-}" != "1" && "${DO_TEST:-}" != "1" ]]; then
   DO_BUILD=1
   DO_IMAGE=1
   DO_RUN=1
@@ -38,9 +39,9 @@ else
 fi
 
 if [[ "$MODE" == "debug" ]]; then
-  CFLAGS="-std=c11 -O0 -g -Wall -Wextra"
+  CFLAGS="-std=c11 -O0 -g -Wall -Wextra -pthread"
 else
-  CFLAGS="-std=c11 -O2 -DNDEBUG -Wall -Wextra"
+  CFLAGS="-std=c11 -O2 -DNDEBUG -Wall -Wextra -pthread"
 fi
 
 if [[ "${DO_IMAGE:-0}" == "1" ]]; then
@@ -77,7 +78,15 @@ if [[ "${DO_RUN:-0}" == "1" ]]; then
   } | tee -a "$OUT"
 fi
 
+if [[ "${DO_TEST:-0}" == "1" ]]; then
+  # Behaviour checks run on a small image of their own, so the disk full case is quick.
+  echo "[test] gcc $MODE"
+  gcc $CFLAGS -Iinclude tests/fs_test.c "$SRC_DIR"/*.c -o fs_test.bin
+  python3 fat_builder.py --size 4MiB --output test.img --init-root-dir
+  ./fs_test.bin test.img test.img.sc
+fi
+
 if [[ "${CLEAN:-0}" == "1" ]]; then
-  echo "[clean] removing bench.bin and $IMG"
-  rm -f bench.bin "$IMG"
+  echo "[clean] removing bench.bin, fs_test.bin and images"
+  rm -f bench.bin fs_test.bin "$IMG" test.img test.img.sc
 fi
@@ -7,6 +7,10 @@
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
 #endif
 
+#ifndef MAX
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+#endif
+
 static inline void str2uppercase(char* s) {
     if (!s) return;
     for (; *s; ++s) *s = (char)toupper((unsigned char)*s);
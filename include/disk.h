@@ -3,6 +3,10 @@
 #define _POSIX_C_SOURCE 200809L
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -10,12 +14,24 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdint.h>
+#include <time.h>
+#include <stdatomic.h>
 
 #define SECTOR_SIZE 512
 
+/* When written data is pushed to stable storage with fdatasync. */
+#define DSK_SYNC_NEVER    0
+#define DSK_SYNC_ON_CLOSE 1
+#define DSK_SYNC_INTERVAL 2   // at most every interval_ms, checked on each write
+#define DSK_SYNC_EVERY_OP 3
+
 int  DSK_host_open(const char* image_path);
 void DSK_host_close(void);
 
+int DSK_set_sync_policy(int policy, unsigned int interval_ms);
+int DSK_sync(void);
+int DSK_sync_close(void);
+
 unsigned char* DSK_read_sector(unsigned int lba);
 unsigned char* DSK_read_sectors(unsigned int lba, unsigned int sector_count);
 unsigned char* DSK_readoff_sectors(unsigned int lba, unsigned int offset, unsigned int sector_count);
@@ -28,5 +44,13 @@ int DSK_copy_sectors2sectors(unsigned int src_lba, unsigned int dst_lba, unsigne
 
 int DSK_read_sectors_into(unsigned int lba, unsigned int sector_count, unsigned char* out);
 int DSK_readoff_sectors_into(unsigned int lba, unsigned int offset, unsigned int sector_count, unsigned char* out);
+int DSK_read_bytes_into(unsigned int lba, unsigned int offset, unsigned int size, unsigned char* out);
+
+/* One preadv/pwritev of the vector at offset bytes past lba; iov is advanced in place on short transfers. */
+int DSK_readv_bytes(unsigned int lba, unsigned int offset, struct iovec* iov, int iovcnt);
+int DSK_writev_bytes(unsigned int lba, unsigned int offset, struct iovec* iov, int iovcnt);
+
+/* Read-only view of size bytes starting offset bytes past lba; valid until DSK_host_close. */
+const unsigned char* DSK_map_bytes(unsigned int lba, unsigned int offset, unsigned int size);
 
 #endif
@@ -0,0 +1,28 @@
+#ifndef DSCAN_H_
+#define DSCAN_H_
+#include <stddef.h>
+#include <string.h>
+#include <stdint.h>
+
+#define DSC_ENTRY_SIZE  32
+#define DSC_ENTRY_END   0x00
+#define DSC_ENTRY_FREE  0xE5
+
+/*
+Result of a directory block scan. The scan stops at the first entry whose
+name matches or at the first end marker; fields are -1 when the slot was
+not seen before that point.
+*/
+typedef struct {
+    int match;
+    int end;
+    int free;
+} DSC_result_t;
+
+/* Scans count 32-byte entries for the 11-byte 8.3 name (NULL - only free/end slots). */
+void DSC_scan(const unsigned char* entries, unsigned int count, const unsigned char* name, DSC_result_t* result);
+
+/* Name of the kernel picked at runtime: "avx2", "sse2" or "scalar". */
+const char* DSC_kernel(void);
+
+#endif
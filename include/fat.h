@@ -5,12 +5,15 @@
 #include "fslib.h"
 #include "compat.h"
 #include "dtime.h"
+#include "dscan.h"
 #include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 #define END_CLUSTER_32      	0x0FFFFFF8
 #define BAD_CLUSTER_32      	0x0FFFFFF7
@@ -69,6 +72,27 @@
 #define CONCAT_ENTRY_HL_BITS(high, low, fat_type) ((high << (fat_type / 2)) | low)
 
 #define CONTENT_TABLE_SIZE	50
+
+#define ALLOC_GROUPS_MAX         64
+#define ALLOC_GROUP_MIN_CLUSTERS 1024
+
+#define DELALLOC_LIMIT           (16 * 1024 * 1024)
+
+#define DIR_INDEX_MAX            32
+#define DIR_READ_WINDOW          16
+#define WALK_MAX_THREADS         64
+#define ASYNC_MAX_THREADS        64
+
+#define LFN_NAME_MAX             255
+#define LFN_UTF8_MAX             (LFN_NAME_MAX * 3)
+#define LFN_CHARS                13
+#define LFN_MAX_SLOTS            20
+#define LFN_LAST                 0x40
+#define LFN_ORDER_MASK           0x1F
+
+#define DCACHE_BUCKETS           4096
+#define DCACHE_MAX               8192
+#define DCACHE_PATH_MAX          512
 #define PATH_DELIMITER      '/'
 
 /* Bpb taken from http://wiki.osdev.org/FAT */
@@ -123,8 +147,18 @@ typedef struct fat_data {
 	unsigned int ext_root_cluster;
 	unsigned int first_fat_sector;
 	unsigned int table_count;
+	unsigned int volume_id;
 } fat_data_t;
 
+typedef struct alloc_group {
+	unsigned int start;
+	unsigned int end;
+	unsigned int cursor;
+	int free_count;         // -1 until the group is first scanned
+	unsigned int handles;   // open handles with affinity to this group
+	pthread_mutex_t lock;
+} alloc_group_t;
+
 typedef struct directory_entry {
 	unsigned char file_name[11];
 	unsigned char attributes;
@@ -140,6 +174,77 @@ typedef struct directory_entry {
 	unsigned int file_size;
 } __attribute__((packed)) directory_entry_t;
 
+typedef struct lfn_entry {
+	unsigned char order;
+	unsigned short name1[5];
+	unsigned char attributes;
+	unsigned char type;
+	unsigned char checksum;
+	unsigned short name2[6];
+	unsigned short first_cluster;
+	unsigned short name3[2];
+} __attribute__((packed)) lfn_entry_t;
+
+typedef struct lfn_state {
+	unsigned int next;            // order expected next, 0 - sequence complete or none
+	unsigned int count;           // slots in the pending sequence, 0 - none
+	unsigned char checksum;
+	unsigned int first_cluster;   // location of the first LFN slot
+	unsigned int first_index;
+	unsigned short chars[LFN_MAX_SLOTS * LFN_CHARS];
+} lfn_state_t;
+
+typedef struct dir_index_entry {
+	directory_entry_t entry;
+	unsigned int entry_cluster;   // directory cluster holding the entry
+	unsigned int entry_index;     // slot inside that cluster
+	int next;                     // bucket chain / free list, -1 terminated
+
+	char* long_name;              // UTF-8, NULL - 8.3 name only
+	unsigned int long_hash;       // case-folded hash of long_name
+	int long_next;                // long name bucket chain
+	unsigned int lfn_cluster;     // first LFN slot of the entry
+	unsigned int lfn_index;
+	unsigned int lfn_count;
+} dir_index_entry_t;
+
+typedef struct dir_slot {
+	unsigned int cluster;
+	unsigned int index;
+} dir_slot_t;
+
+typedef struct dir_index {
+	unsigned int cluster;         // first cluster of the directory, 0 - unused
+	unsigned int stamp;
+	dir_index_entry_t* entries;
+	unsigned int count;
+	unsigned int capacity;
+	unsigned int live;
+	int free_head;
+	int* buckets;
+	int* long_buckets;
+	unsigned int bucket_count;
+
+	dir_slot_t* holes;            // ENTRY_FREE slots ready for reuse
+	unsigned int hole_count;
+	unsigned int hole_capacity;
+	unsigned int end_cluster;     // first ENTRY_END slot, 0 - every slot of the chain is used
+	unsigned int end_index;
+	unsigned int last_cluster;
+} dir_index_t;
+
+typedef struct dentry {
+	char* path;
+	unsigned int hash;
+	int negative;
+	directory_entry_t entry;
+	unsigned int parent_cluster;  // first cluster of the directory holding the entry
+	unsigned int entry_cluster;   // 0 for the root directory
+	unsigned int entry_index;
+	struct dentry* next;
+	struct dentry* loc_next;
+} dentry_t;
+
 typedef struct FATFile {
 	char name[8];
 	char extension[4];
@@ -169,25 +274,149 @@ typedef struct FATContent {
 	unsigned int parent_cluster;
 	directory_entry_t meta;
 	ContentType content_type;
+	int alloc_group;
+	unsigned int entry_cluster;
+	unsigned int entry_index;
+
+	char* long_name;                     // set by FAT_create_object when the name does not fit 8.3
+
+	unsigned char* delalloc;             // bytes staged past the allocated tail
+	unsigned int delalloc_size;
+	unsigned int delalloc_capacity;
+	int delalloc_enabled;
+
+	unsigned char* wbuf;                 // small contiguous writes merged before they reach the disk
+	unsigned int wbuf_offset;            // file offset of wbuf[0]
+	unsigned int wbuf_size;
+	unsigned int wbuf_capacity;          // 0 - writes go straight to disk
+
+	int meta_dirty;                      // size/mtime changed since the entry was last written back
+	unsigned int position;               // cursor of FAT_read/FAT_write/FAT_seek
+	unsigned int async_inflight;         // async requests submitted on this handle and not completed
 } Content;
 
+/* One physically contiguous extent of a mapped file range, read-only. */
+typedef struct {
+	const unsigned char* data;
+	unsigned int size;
+} ContentSpan_t;
+
+typedef struct {
+	unsigned int files;
+	unsigned int fragmented_files;
+	unsigned int clusters;
+	unsigned int extents;
+	double score;           // 0 - every file contiguous, 1 - one extent per cluster
+} FragReport_t;
+
+typedef struct dir_window {
+	unsigned int next;            // first cluster not read yet
+	unsigned int total;           // clusters read so far, guards against looped chains
+	unsigned int count;           // clusters in data
+	unsigned int capacity;
+	unsigned int clusters[DIR_READ_WINDOW];
+	unsigned char* data;          // count clusters back to back
+} dir_window_t;
+
+typedef struct {
+	unsigned int first_cluster;
+	unsigned int position;        // next entry inside the window
+	dir_window_t window;
+	lfn_state_t lfn;
+} DirIter_t;
+
+typedef struct {
+	directory_entry_t entry;
+	char name[13];                // "NAME.EXT" without padding
+	char long_name[LFN_UTF8_MAX + 1]; // empty if the entry has no long name
+	unsigned int entry_cluster;
+	unsigned int entry_index;
+} DirEntry_t;
+
+typedef void (*frag_visitor_t)(const char* path, unsigned int clusters, unsigned int extents, void* ctx);
+
+/*
+Called from the walk's worker threads, concurrently. Return 0 to go on,
+1 to skip the subtree of a directory, a negative value to stop the walk.
+*/
+typedef int (*walk_visitor_t)(const char* path, const DirEntry_t* item, void* ctx);
+typedef void (*find_visitor_t)(const char* path, const DirEntry_t* item, void* ctx);
+
+typedef struct {
+	int ticket;
+	int ci;
+	int result;                     // bytes read or written up to the first failed run, negative on error
+	unsigned char* buffer;
+} AsyncCompletion_t;
+
+/*
+Called from an I/O worker thread as each request completes. Synchronous calls
+on a handle wait for its in-flight requests first, and delete and defragment
+wait for all of them, so the callback must not read, write, map, flush, close,
+delete or defragment; it should only hand the completion on.
+*/
+typedef void (*async_callback_t)(const AsyncCompletion_t* completion, void* ctx);
+
+typedef struct {
+	unsigned long long files;
+	unsigned long long directories;
+	unsigned long long bytes;       // sum of file sizes
+	unsigned long long clusters;    // clusters held by files and subdirectories
+	unsigned long long allocated;   // clusters in bytes
+} DuReport_t;
+
 extern fat_data_t FAT_data;
 
 int FAT_initialize(); 
+int FAT_unmount();
+int FAT_set_sidecar(const char* path);
+int FAT_sidecar_loaded();
 int FAT_directory_list(int ci, unsigned char attrs, int exclusive);
+int FAT_directory_open(const char* path, DirIter_t* it);
+int FAT_directory_open_cluster(unsigned int cluster, DirIter_t* it);
+int FAT_directory_next(DirIter_t* it, DirEntry_t* item);
+void FAT_directory_close(DirIter_t* it);
+int FAT_directory_compact(const char* path);
 
 int FAT_content_exists(const char* path);
 int FAT_open_content(const char* path);
 int FAT_close_content(int ci);
 int FAT_read_content2buffer(int ci, unsigned char* buffer, unsigned int offset, unsigned int size);
+int FAT_map_content(int ci, unsigned int offset, unsigned int size, ContentSpan_t** spans);
+void FAT_unmap_content(ContentSpan_t* spans);
+int FAT_read(int ci, unsigned char* buffer, unsigned int size);
+int FAT_write(int ci, const unsigned char* buffer, unsigned int size);
+long long FAT_seek(int ci, long long offset, int whence);
+int FAT_readv(int ci, const struct iovec* iov, int iovcnt, unsigned int offset);
+int FAT_writev(int ci, const struct iovec* iov, int iovcnt, unsigned int offset);
 //int FAT_read_content2buffer_stop(int ci, unsigned char* buffer, unsigned int offset, unsigned int size, unsigned char* stop);
 int FAT_put_content(const char* path, Content* content);
+int FAT_put_contents(const char* path, Content** contents, int count);
 int FAT_delete_content(const char* path);
 int FAT_write_buffer2content(int ci, const unsigned char* buffer, unsigned int offset, unsigned int size);
+int FAT_fallocate(int ci, unsigned int size);
+int FAT_set_delalloc(int ci, int enabled);
+int FAT_set_write_buffer(int ci, unsigned int size);
+int FAT_flush(int ci);
+int FAT_sync();
+int FAT_async_start(int threads, async_callback_t callback, void* ctx);
+int FAT_async_stop();
+int FAT_read_async(int ci, unsigned char* buffer, unsigned int offset, unsigned int size);
+int FAT_write_async(int ci, const unsigned char* buffer, unsigned int offset, unsigned int size);
+int FAT_async_poll(AsyncCompletion_t* completions, int max);
+int FAT_async_wait(AsyncCompletion_t* completions, int max);
 //int FAT_ELF_execute_content(int ci, int argc, char* argv[], int type);
 int FAT_change_meta(const char* path, const char* new_name);
 int FAT_stat_content(int ci, CInfo_t* info);
 
+int FAT_fragmentation_report(const char* path, FragReport_t* report, frag_visitor_t visitor, void* ctx);
+int FAT_defragment_content(const char* path);
+int FAT_defragment(const char* path);
+
+int FAT_walk(const char* path, int threads, walk_visitor_t visitor, void* ctx);
+int FAT_du(const char* path, int threads, DuReport_t* report);
+int FAT_find(const char* path, const char* pattern, int threads, find_visitor_t visitor, void* ctx);
+
 unsigned short _current_date();
 void _fatname2name(char* input, char* output);
 char* _name2fatname(char* input);
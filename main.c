@@ -38,15 +38,49 @@ static int verify_pattern(const unsigned char* p, size_t n, uint32_t seed) {
 
 int main(int argc, char** argv) {
     if (argc < 4) {
-        fprintf(stderr, "Usage: %s <N_files> <rw_mb> <img>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <N_files> <rw_mb> <img> [--prealloc] [--delalloc] [--batch] [--sidecar <path>] [--sync never|close|op|<ms>] [--async]\n", argv[0]);
         return 1;
     }
 
     unsigned int N = (unsigned int)atoi(argv[1]);
     unsigned int RW_MB = (unsigned int)atoi(argv[2]);
     const char* img = argv[3];
+
+    int prealloc = 0;
+    int delalloc = 0;
+    int batch = 0;
+    int async = 0;
+    const char* sidecar = NULL;
+    const char* sync = "never";
+    int sync_policy = DSK_SYNC_NEVER;
+    unsigned int sync_ms = 0;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--prealloc") == 0) prealloc = 1;
+        else if (strcmp(argv[i], "--delalloc") == 0) delalloc = 1;
+        else if (strcmp(argv[i], "--batch") == 0) batch = 1;
+        else if (strcmp(argv[i], "--async") == 0) async = 1;
+        else if (strcmp(argv[i], "--sidecar") == 0 && i + 1 < argc) sidecar = argv[++i];
+        else if (strcmp(argv[i], "--sync") == 0 && i + 1 < argc) {
+            sync = argv[++i];
+            if (strcmp(sync, "never") == 0) sync_policy = DSK_SYNC_NEVER;
+            else if (strcmp(sync, "close") == 0) sync_policy = DSK_SYNC_ON_CLOSE;
+            else if (strcmp(sync, "op") == 0) sync_policy = DSK_SYNC_EVERY_OP;
+            else if ((sync_ms = (unsigned int)atoi(sync)) > 0) sync_policy = DSK_SYNC_INTERVAL;
+            else {
+                fprintf(stderr, "Unknown sync policy: %s\n", sync);
+                return 1;
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
     if (!DSK_host_open(img)) return 1;
-    printf("N=%u, RW_MB=%u, img=%s\n", N, RW_MB, img);
+    DSK_set_sync_policy(sync_policy, sync_ms);
+    printf("N=%u, RW_MB=%u, img=%s, sync=%s\n", N, RW_MB, img, sync);
+    if (sidecar) FAT_set_sidecar(sidecar);
 
     uint64_t t_init = MEASURE_US({
         if (FAT_initialize() != 0) {
@@ -59,7 +93,7 @@ int main(int argc, char** argv) {
         fprintf(stdout, "Creating bench directory...\n");
 
         Content* d = FAT_create_object("BENCH", 1, "");
-        int sput_res = FAT_put_content("ROOT", d);
+        int sput_res = d ? FAT_put_content("ROOT", d) : -1;
         FAT_unload_content_system(d);
 
         fprintf(stdout, "Put results: %i\n", sput_res);
@@ -71,14 +105,50 @@ int main(int argc, char** argv) {
     }
 
     uint64_t t_create = 0;
-    for (unsigned int i = 0; i < N; i++) {
-        char name[32];
-        make_name(name, sizeof(name), i);
+    if (batch) {
+        Content** objs = malloc(N * sizeof(Content*));
+        if (!objs) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        int put_res = 0;
         t_create += MEASURE_US({
-            Content* o = FAT_create_object(name, 0, "bin");
-            FAT_put_content("ROOT/BENCH", o);
-            FAT_unload_content_system(o);
+            for (unsigned int i = 0; i < N; i++) {
+                char name[32];
+                make_name(name, sizeof(name), i);
+                objs[i] = FAT_create_object(name, 0, "bin");
+                if (!objs[i]) put_res = -1;
+            }
+
+            if (put_res == 0) put_res = FAT_put_contents("ROOT/BENCH", objs, (int)N);
+            for (unsigned int i = 0; i < N; i++) if (objs[i]) FAT_unload_content_system(objs[i]);
         });
+
+        free(objs);
+        if (put_res != (int)N) {
+            fprintf(stderr, "put_contents failed: %i\n", put_res);
+            return 1;
+        }
+    }
+    else {
+        for (unsigned int i = 0; i < N; i++) {
+            char name[32];
+            make_name(name, sizeof(name), i);
+            int put_res = -1;
+            t_create += MEASURE_US({
+                Content* o = FAT_create_object(name, 0, "bin");
+                if (o) {
+                    put_res = FAT_put_content("ROOT/BENCH", o);
+                    FAT_unload_content_system(o);
+                }
+            });
+
+            if (put_res != 1) {
+                fprintf(stderr, "put_content failed for %s: %i\n", name, put_res);
+                return 1;
+            }
+        }
     }
 
     int ci = FAT_open_content("ROOT/BENCH/f0000000.bin");
@@ -90,48 +160,142 @@ int main(int argc, char** argv) {
     const size_t chunk = 4096;
     const size_t total_bytes = (size_t)RW_MB * 1024 * 1024;
     unsigned char* buf = malloc(chunk);
+    unsigned char* rbuf = malloc(chunk);
+    if (!buf || !rbuf) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
 
     uint64_t t_append = 0;
     size_t off = 0;
     uint32_t seed = 0x12345678;
 
+    if (prealloc) {
+        int alloc_res = 0;
+        t_append += MEASURE_US({
+            alloc_res = FAT_fallocate(ci, (unsigned int)total_bytes);
+        });
+
+        if (alloc_res != 0) {
+            fprintf(stderr, "fallocate failed: %i\n", alloc_res);
+            return 1;
+        }
+    }
+    if (delalloc && FAT_set_delalloc(ci, 1) != 0) {
+        fprintf(stderr, "set_delalloc failed\n");
+        return 1;
+    }
+
     while (off < total_bytes) {
         size_t n = (total_bytes - off > chunk) ? chunk : (total_bytes - off);
         fill_pattern(buf, n, seed);
 
+        int written = 0;
         t_append += MEASURE_US({
-            FAT_write_buffer2content(ci, buf, off, (unsigned int)n);
+            written = FAT_write_buffer2content(ci, buf, off, (unsigned int)n);
         });
 
+        if (written != (int)n) {
+            fprintf(stderr, "write failed at offset %zu\n", off);
+            return 1;
+        }
+
         off += n;
     }
 
-    unsigned char* rbuf = malloc(chunk);
+    /* With a sync policy the append is timed until the data is durable. */
+    int flush_res = 0;
+    t_append += MEASURE_US({
+        flush_res = FAT_flush(ci);
+        if (flush_res == 0 && sync_policy != DSK_SYNC_NEVER) flush_res = FAT_sync();
+    });
+
+    if (flush_res != 0) {
+        fprintf(stderr, "flush failed: %i\n", flush_res);
+        return 1;
+    }
+
+    int verify_res = 0;
     uint64_t t_read = 0;
     off = 0;
     seed = 0x12345678;
 
-    while (off < total_bytes) {
-        size_t n = (total_bytes - off > chunk) ? chunk : (total_bytes - off);
+    if (async) {
+        /* Every chunk is in flight at once; verified after the last completion. */
+        unsigned char* abuf = malloc(total_bytes ? total_bytes : 1);
+        if (!abuf) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+
+        /* A failed submission or a short completion fails the read. */
         t_read += MEASURE_US({
-            FAT_read_content2buffer(ci, rbuf, off, (unsigned int)n);
+            for (size_t at = 0; at < total_bytes; at += chunk) {
+                size_t n = (total_bytes - at > chunk) ? chunk : (total_bytes - at);
+                if (FAT_read_async(ci, abuf + at, (unsigned int)at, (unsigned int)n) < 0) verify_res = -1;
+            }
+
+            AsyncCompletion_t done[64];
+            size_t got_bytes = 0;
+            for (int got; (got = FAT_async_wait(done, 64)) > 0;) {
+                for (int i = 0; i < got; i++) {
+                    if (done[i].result < 0) verify_res = -1;
+                    else got_bytes += (size_t)done[i].result;
+                }
+            }
+
+            if (got_bytes != total_bytes) verify_res = -1;
         });
 
-        if (verify_pattern(rbuf, n, seed) != 0) {
-            fprintf(stderr, "verify failed at offset %zu\n", off);
-            break;
+        if (verify_res != 0) fprintf(stderr, "async read failed\n");
+        for (; verify_res == 0 && off < total_bytes; off += chunk) {
+            size_t n = (total_bytes - off > chunk) ? chunk : (total_bytes - off);
+            if (verify_pattern(abuf + off, n, seed) != 0) {
+                fprintf(stderr, "verify failed at offset %zu\n", off);
+                verify_res = -1;
+            }
         }
 
-        off += n;
+        free(abuf);
+    }
+    else {
+        while (off < total_bytes) {
+            size_t n = (total_bytes - off > chunk) ? chunk : (total_bytes - off);
+            int read = 0;
+            t_read += MEASURE_US({
+                read = FAT_read_content2buffer(ci, rbuf, off, (unsigned int)n);
+            });
+
+            if (read != (int)n || verify_pattern(rbuf, n, seed) != 0) {
+                fprintf(stderr, "verify failed at offset %zu\n", off);
+                verify_res = -1;
+                break;
+            }
+
+            off += n;
+        }
     }
 
-    FAT_close_content(ci);
+    int close_res = FAT_close_content(ci);
     free(buf);
     free(rbuf);
+    if (close_res < 0) {
+        fprintf(stderr, "close failed: %i\n", close_res);
+        return 1;
+    }
+
+    FragReport_t frag;
+    int frag_res = FAT_fragmentation_report("ROOT/BENCH", &frag, NULL, NULL);
+
+    DuReport_t du;
+    int du_res = -1;
+    uint64_t t_du = MEASURE_US({ du_res = FAT_du("ROOT/BENCH", 0, &du); });
+    int sidecar_loaded = FAT_sidecar_loaded();
+    FAT_unmount();
     DSK_host_close();
 
     printf("\n==== FS BENCH ====\n");
-    printf("init:          %8.6f ms\n", (double)t_init / 1000.0);
+    printf("init:          %8.6f ms%s\n", (double)t_init / 1000.0, sidecar_loaded ? " (sidecar)" : "");
     printf("create %u:     %8.6f ms (%.2f us/op)\n", N, (double)t_create / 1000.0, (double)t_create / (double)N);
     printf("append %u MB:  %8.6f ms (%.2f MB/s)\n",
            RW_MB,
@@ -141,7 +305,15 @@ int main(int argc, char** argv) {
            RW_MB,
            (double)t_read / 1000.0,
            (double)RW_MB / ((double)t_read / 1000000.0));
+    if (frag_res == 0) {
+        printf("frag:          %u files, %u extents, %u fragmented (score %.3f)\n",
+               frag.files, frag.extents, frag.fragmented_files, frag.score);
+    }
+    if (du_res == 0) {
+        printf("du:            %llu files, %llu clusters in %8.6f ms\n",
+               du.files, du.clusters, (double)t_du / 1000.0);
+    }
     printf("==================\n");
 
-    return 0;
+    return (verify_res == 0) ? 0 : 1;
 }
\ No newline at end of file
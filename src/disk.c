@@ -1,11 +1,31 @@
+#define _DEFAULT_SOURCE   // preadv/pwritev
 #include "disk.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 static int  g_fd = -1;
 static char g_img_path[1024] = "disk.img";
 
+static unsigned char* g_map = NULL;
+static size_t g_map_size = 0;
+
+static int g_sync_policy = DSK_SYNC_NEVER;
+static unsigned int g_sync_interval_ms = 0;
+static atomic_ullong g_last_sync_ms = 0;
+static atomic_int g_unsynced = 0;     // written to from the async I/O workers as well
+
+static void unmap_image(void) {
+    if (g_map) munmap(g_map, g_map_size);
+    g_map = NULL;
+    g_map_size = 0;
+}
+
 static int _host_set_image(const char* path) {
     if (!path || !path[0]) return 0;
     snprintf(g_img_path, sizeof(g_img_path), "%s", path);
+    unmap_image();
     if (g_fd >= 0) {
         close(g_fd);
         g_fd = -1;
@@ -36,10 +56,62 @@ int DSK_host_open(const char* image_path) {
 }
 
 void DSK_host_close(void) {
-    if (g_fd >= 0) close(g_fd);
+    unmap_image();
+    if (g_fd >= 0) {
+        if (g_sync_policy != DSK_SYNC_NEVER) DSK_sync();
+        close(g_fd);
+    }
+
     g_fd = -1;
 }
 
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ull + (uint64_t)ts.tv_nsec / 1000000ull;
+}
+
+int DSK_set_sync_policy(int policy, unsigned int interval_ms) {
+    if (policy < DSK_SYNC_NEVER || policy > DSK_SYNC_EVERY_OP) return 0;
+    if (policy == DSK_SYNC_INTERVAL && interval_ms == 0) return 0;
+
+    g_sync_policy = policy;
+    g_sync_interval_ms = interval_ms;
+    atomic_store(&g_last_sync_ms, now_ms());
+    return 1;
+}
+
+/* Flushes written data to stable storage; a no-op when nothing was written since the last sync. */
+int DSK_sync(void) {
+    if (g_fd < 0 || !atomic_exchange(&g_unsynced, 0)) return 1;
+
+    int r;
+    do r = fdatasync(g_fd);
+    while (r != 0 && errno == EINTR);
+    if (r != 0) {
+        atomic_store(&g_unsynced, 1);
+        fprintf(stderr, "[DSK] fdatasync('%s') failed: %s\n", g_img_path, strerror(errno));
+        return 0;
+    }
+
+    atomic_store(&g_last_sync_ms, now_ms());
+    return 1;
+}
+
+/* The sync owed when a file is closed: only the on-close policy defers it to this point. */
+int DSK_sync_close(void) {
+    return (g_sync_policy == DSK_SYNC_ON_CLOSE) ? DSK_sync() : 1;
+}
+
+static int after_write(int ok) {
+    if (!ok) return 0;
+
+    atomic_store(&g_unsynced, 1);
+    if (g_sync_policy == DSK_SYNC_EVERY_OP) return DSK_sync();
+    if (g_sync_policy == DSK_SYNC_INTERVAL && now_ms() - g_last_sync_ms >= g_sync_interval_ms) return DSK_sync();
+    return 1;
+}
+
 static int full_pread(void* buf, size_t n, off_t off) {
     unsigned char* p = (unsigned char*)buf;
     size_t done = 0;
@@ -73,6 +145,38 @@ static int full_pwrite(const void* buf, size_t n, off_t off) {
     return 0;
 }
 
+static int full_iov(struct iovec* iov, int count, off_t off, int write) {
+    while (count > 0) {
+        if (iov->iov_len == 0) {
+            iov++;
+            count--;
+            continue;
+        }
+
+        int batch = (count < IOV_MAX) ? count : IOV_MAX;
+        ssize_t r = write ? pwritev(g_fd, iov, batch, off) : preadv(g_fd, iov, batch, off);
+        if (r <= 0) {
+            if (r < 0 && errno == EINTR) continue;
+            return -1;
+        }
+
+        off += (off_t)r;
+        size_t done = (size_t)r;
+        while (count > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0) {
+            iov->iov_base = (unsigned char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+
+    return 0;
+}
+
 int DSK_read_sectors_into(unsigned int lba, unsigned int count, unsigned char* out) {
     if (!out) return 0;
     if (!ensure_open()) return 0;
@@ -93,6 +197,55 @@ int DSK_readoff_sectors_into(unsigned int lba, unsigned int offset, unsigned int
     return (full_pread(out, bytes, off) == 0) ? 1 : 0;
 }
 
+/* Reads exactly size bytes starting offset bytes past lba. */
+int DSK_read_bytes_into(unsigned int lba, unsigned int offset, unsigned int size, unsigned char* out) {
+    if (!out) return 0;
+    if (!ensure_open()) return 0;
+
+    off_t off = (off_t)((uint64_t)lba * (uint64_t)SECTOR_SIZE + (uint64_t)offset);
+    return (full_pread(out, (size_t)size, off) == 0) ? 1 : 0;
+}
+
+int DSK_readv_bytes(unsigned int lba, unsigned int offset, struct iovec* iov, int iovcnt) {
+    if (!iov || !ensure_open()) return 0;
+
+    off_t off = (off_t)((uint64_t)lba * (uint64_t)SECTOR_SIZE + (uint64_t)offset);
+    return (full_iov(iov, iovcnt, off, 0) == 0) ? 1 : 0;
+}
+
+int DSK_writev_bytes(unsigned int lba, unsigned int offset, struct iovec* iov, int iovcnt) {
+    if (!iov || !ensure_open()) return 0;
+
+    off_t off = (off_t)((uint64_t)lba * (uint64_t)SECTOR_SIZE + (uint64_t)offset);
+    return after_write(full_iov(iov, iovcnt, off, 1) == 0);
+}
+
+/* The whole image is mapped shared on first use, so it sees every pwrite through g_fd. */
+static int ensure_map(void) {
+    if (g_map) return 1;
+    if (!ensure_open()) return 0;
+
+    struct stat st;
+    if (fstat(g_fd, &st) != 0 || st.st_size <= 0) return 0;
+
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, g_fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "[DSK] mmap('%s') failed: %s\n", g_img_path, strerror(errno));
+        return 0;
+    }
+
+    g_map = (unsigned char*)map;
+    g_map_size = (size_t)st.st_size;
+    return 1;
+}
+
+const unsigned char* DSK_map_bytes(unsigned int lba, unsigned int offset, unsigned int size) {
+    if (!ensure_map()) return NULL;
+
+    uint64_t off = (uint64_t)lba * (uint64_t)SECTOR_SIZE + (uint64_t)offset;
+    if (off > g_map_size || (uint64_t)size > g_map_size - off) return NULL;
+    return g_map + off;
+}
 
 unsigned char* DSK_read_sector(unsigned int lba) {
     return DSK_read_sectors(lba, 1);
@@ -134,7 +287,7 @@ int DSK_write_sectors(unsigned int lba, const unsigned char* data, unsigned int
     size_t bytes = (size_t)count * SECTOR_SIZE;
     off_t off = (off_t)((uint64_t)lba * (uint64_t)SECTOR_SIZE);
 
-    return (full_pwrite(data, bytes, off) == 0) ? 1 : 0;
+    return after_write(full_pwrite(data, bytes, off) == 0);
 }
 
 int DSK_writeoff_sectors(unsigned int lba, const unsigned char* data, unsigned int count, unsigned int offset, unsigned int size) {
@@ -147,7 +300,7 @@ int DSK_writeoff_sectors(unsigned int lba, const unsigned char* data, unsigned i
 
     off_t off = (off_t)((uint64_t)lba * (uint64_t)SECTOR_SIZE + (uint64_t)offset);
 
-    return (full_pwrite(data, (size_t)size, off) == 0) ? 1 : 0;
+    return after_write(full_pwrite(data, (size_t)size, off) == 0);
 }
 
 int DSK_copy_sectors2sectors(unsigned int src_lba, unsigned int dst_lba, unsigned int count) {
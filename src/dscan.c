@@ -0,0 +1,149 @@
+#include "dscan.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DSC_X86 1
+#endif
+
+typedef void (*dsc_kernel_t)(const unsigned char*, unsigned int, const unsigned char*, DSC_result_t*);
+
+/* Classifies one entry; returns 1 when the scan has to stop there. */
+static inline int dsc_step(const unsigned char* entry, unsigned int i, int matched, DSC_result_t* result) {
+    if (entry[0] == DSC_ENTRY_END) {
+        result->end = (int)i;
+        return 1;
+    }
+
+    if (entry[0] == DSC_ENTRY_FREE) {
+        if (result->free < 0) result->free = (int)i;
+        return 0;
+    }
+
+    if (matched) {
+        result->match = (int)i;
+        return 1;
+    }
+
+    return 0;
+}
+
+static void dsc_scan_scalar(const unsigned char* entries, unsigned int count, const unsigned char* name, DSC_result_t* result) {
+    for (unsigned int i = 0; i < count; i++) {
+        const unsigned char* entry = entries + (size_t)i * DSC_ENTRY_SIZE;
+        int matched = name && memcmp(entry, name, 11) == 0;
+        if (dsc_step(entry, i, matched, result)) return;
+    }
+}
+
+#ifdef DSC_X86
+/*
+The name occupies the first 11 bytes of an entry, so one 16-byte compare per
+entry covers it. End and free markers are tested on the same vectors, so the
+hot loop takes one branch per group of entries; only a group that holds
+something of interest is walked entry by entry.
+*/
+#define DSC_NAME_MASK 0x7FF
+
+static inline int dsc_hit(unsigned int eq, unsigned int marks) {
+    return ((eq & DSC_NAME_MASK) == DSC_NAME_MASK) | (marks & 1);
+}
+
+__attribute__((target("sse2")))
+static void dsc_scan_sse2(const unsigned char* entries, unsigned int count, const unsigned char* name, DSC_result_t* result) {
+    unsigned char pattern[16] = { 0 };
+    if (name) memcpy(pattern, name, 11);
+    __m128i target = _mm_loadu_si128((const __m128i*)pattern);
+    __m128i end    = _mm_setzero_si128();
+    __m128i free   = _mm_set1_epi8((char)DSC_ENTRY_FREE);
+
+    unsigned int i = 0;
+    for (; i + 1 < count; i += 2) {
+        const unsigned char* entry = entries + (size_t)i * DSC_ENTRY_SIZE;
+        __m128i first  = _mm_loadu_si128((const __m128i*)entry);
+        __m128i second = _mm_loadu_si128((const __m128i*)(entry + DSC_ENTRY_SIZE));
+
+        unsigned int eq0 = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(first, target));
+        unsigned int eq1 = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(second, target));
+        unsigned int mk0 = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(first, end), _mm_cmpeq_epi8(first, free)));
+        unsigned int mk1 = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(second, end), _mm_cmpeq_epi8(second, free)));
+        if (!(dsc_hit(eq0, mk0) | dsc_hit(eq1, mk1))) continue;
+
+        if (dsc_step(entry, i, name && (eq0 & DSC_NAME_MASK) == DSC_NAME_MASK, result)) return;
+        if (dsc_step(entry + DSC_ENTRY_SIZE, i + 1, name && (eq1 & DSC_NAME_MASK) == DSC_NAME_MASK, result)) return;
+    }
+
+    if (i < count) {
+        const unsigned char* entry = entries + (size_t)i * DSC_ENTRY_SIZE;
+        dsc_step(entry, i, name && memcmp(entry, name, 11) == 0, result);
+    }
+}
+
+/* Four entries per step: the name halves of two entries share one 256-bit register. */
+__attribute__((target("avx2")))
+static void dsc_scan_avx2(const unsigned char* entries, unsigned int count, const unsigned char* name, DSC_result_t* result) {
+    unsigned char pattern[16] = { 0 };
+    if (name) memcpy(pattern, name, 11);
+    __m256i target = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)pattern));
+    __m256i end    = _mm256_setzero_si256();
+    __m256i free   = _mm256_set1_epi8((char)DSC_ENTRY_FREE);
+
+    unsigned int i = 0;
+    for (; i + 3 < count; i += 4) {
+        const unsigned char* entry = entries + (size_t)i * DSC_ENTRY_SIZE;
+        unsigned int eq[2], mk[2];
+        for (int h = 0; h < 2; h++) {
+            const unsigned char* pair_entry = entry + (size_t)h * 2 * DSC_ENTRY_SIZE;
+            __m128i low  = _mm_loadu_si128((const __m128i*)pair_entry);
+            __m128i high = _mm_loadu_si128((const __m128i*)(pair_entry + DSC_ENTRY_SIZE));
+            __m256i pair = _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+
+            eq[h] = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(pair, target));
+            mk[h] = (unsigned int)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(pair, end), _mm256_cmpeq_epi8(pair, free)));
+        }
+
+        if (!(dsc_hit(eq[0], mk[0]) | dsc_hit(eq[0] >> 16, mk[0] >> 16) | dsc_hit(eq[1], mk[1]) | dsc_hit(eq[1] >> 16, mk[1] >> 16))) continue;
+
+        for (unsigned int k = 0; k < 4; k++) {
+            unsigned int bits = eq[k >> 1] >> ((k & 1) * 16);
+            if (dsc_step(entry + (size_t)k * DSC_ENTRY_SIZE, i + k, name && (bits & DSC_NAME_MASK) == DSC_NAME_MASK, result)) return;
+        }
+    }
+
+    for (; i < count; i++) {
+        const unsigned char* entry = entries + (size_t)i * DSC_ENTRY_SIZE;
+        if (dsc_step(entry, i, name && memcmp(entry, name, 11) == 0, result)) return;
+    }
+}
+#endif
+
+static dsc_kernel_t dsc_kernel = dsc_scan_scalar;
+static const char* dsc_kernel_name = "scalar";
+static pthread_once_t dsc_once = PTHREAD_ONCE_INIT;
+
+static void dsc_select(void) {
+#ifdef DSC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        dsc_kernel = dsc_scan_avx2;
+        dsc_kernel_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        dsc_kernel = dsc_scan_sse2;
+        dsc_kernel_name = "sse2";
+    }
+#endif
+}
+
+void DSC_scan(const unsigned char* entries, unsigned int count, const unsigned char* name, DSC_result_t* result) {
+    pthread_once(&dsc_once, dsc_select);
+    result->match = -1;
+    result->end   = -1;
+    result->free  = -1;
+    dsc_kernel(entries, count, name, result);
+}
+
+const char* DSC_kernel(void) {
+    pthread_once(&dsc_once, dsc_select);
+    return dsc_kernel_name;
+}
@@ -2,7 +2,21 @@
 
 fat_data_t FAT_data;
 static Content* _content_table[CONTENT_TABLE_SIZE];
-static unsigned int last_allocated_cluster = 2;
+static pthread_mutex_t _content_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void _alloc_groups_init();
+static void _dir_index_reset();
+static void _dcache_reset();
+static void _dcache_refresh(unsigned int entry_cluster, unsigned int entry_index, const directory_entry_t* entry);
+static int _content_flush_delalloc(int ci);
+static int _content_flush_wbuf(int ci);
+static void _async_quiesce(int ci);
+static int _content_stage(Content* c, const unsigned char* data, unsigned int at, unsigned int size);
+static unsigned int _content_size(Content* c);
+static int _content_write_prepare(int ci, const unsigned char* buffer, unsigned int offset, unsigned int* psize);
+static int _content_zero_gap(Content* c, unsigned int offset);
+static int _sidecar_load();
+static int _volume_set_clean(int clean);
 
 static inline uint16_t _rd16(const unsigned char* p) {
     return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
@@ -71,6 +85,7 @@ int FAT_initialize() {
     FAT_data.fat_size = fat_size;
     FAT_data.fat_type = 32;
     FAT_data.ext_root_cluster = ((fat_extBS_32_t*)(bpb->extended_section))->root_cluster;
+    FAT_data.volume_id = ((fat_extBS_32_t*)(bpb->extended_section))->volume_id;
 
     unsigned int root_dir_sectors =
         ((unsigned int)bpb->root_entry_count * 32u + (FAT_data.bytes_per_sector - 1u)) / FAT_data.bytes_per_sector;
@@ -86,20 +101,40 @@ int FAT_initialize() {
     free(cluster_data);
 
     for (int i = 0; i < CONTENT_TABLE_SIZE; i++) _content_table[i] = NULL;
-    last_allocated_cluster = 2;
 	fat_cache_init();
+    _alloc_groups_init();
+    _dir_index_reset();
+    _dcache_reset();
+
+    /* The sidecar is only trusted while the volume is marked clean, so the mark is dropped for the mount. */
+    _sidecar_load();
+    if (_volume_set_clean(0) != 0) {
+        printf("FAT_initialize: cannot clear the clean shutdown bit\n");
+    }
+
     return 0;
 }
 
 static unsigned char** fat_cache = NULL;
+static unsigned char* fat_dirty = NULL;
 static unsigned int fat_cache_sectors = 0;
+static _Thread_local int fat_batch_depth = 0;
 
 int fat_cache_init() {
     if (fat_cache) return 0;
 
     fat_cache_sectors = FAT_data.fat_size * FAT_data.table_count;
     fat_cache = calloc(fat_cache_sectors, sizeof(unsigned char*));
-    return fat_cache ? 0 : -1;
+    fat_dirty = calloc(fat_cache_sectors, sizeof(unsigned char));
+    if (!fat_cache || !fat_dirty) {
+        free(fat_cache);
+        free(fat_dirty);
+        fat_cache = NULL;
+        fat_dirty = NULL;
+        return -1;
+    }
+
+    return 0;
 }
 
 static unsigned char* _fat_get_sector(unsigned int sector) {
@@ -114,7 +149,17 @@ static unsigned char* _fat_get_sector(unsigned int sector) {
     return fat_cache[rel];
 }
 
-static int __read_fat(unsigned int cluster) {
+/* Inside a FAT batch the cached sector is only marked dirty and written once by _fat_batch_end. */
+static int _fat_store_sector(unsigned int sector, const unsigned char* data) {
+    if (fat_batch_depth > 0) {
+        fat_dirty[sector - FAT_data.first_fat_sector] = 1;
+        return 0;
+    }
+
+    return (DSK_write_sectors(sector, data, 1) == 1) ? 0 : -1;
+}
+
+static int __read_fat_unlocked(unsigned int cluster) {
     if (fat_cache_init() != 0) return -1;
 
     unsigned int fat_offset = cluster * 4u;
@@ -178,7 +223,7 @@ static int __write_fat_one(unsigned int fat_first_sector, unsigned int cluster,
         s0[ent_off + 2] = (unsigned char)((newv >> 16) & 0xFF);
         s0[ent_off + 3] = (unsigned char)((newv >> 24) & 0xFF);
 
-        return (DSK_write_sectors(fat_sector, s0, 1) == 1) ? 0 : -1;
+        return _fat_store_sector(fat_sector, s0);
     } 
 	else {
         unsigned char* s0 = _fat_get_sector(fat_sector);
@@ -210,14 +255,14 @@ static int __write_fat_one(unsigned int fat_first_sector, unsigned int cluster,
         for (unsigned int i = first; i < 4; i++)
             s1[i - first] = tmp[i];
 
-        if (DSK_write_sectors(fat_sector, s0, 1) != 1) return -1;
-        if (DSK_write_sectors(fat_sector + 1, s1, 1) != 1) return -1;
+        if (_fat_store_sector(fat_sector, s0) != 0) return -1;
+        if (_fat_store_sector(fat_sector + 1, s1) != 0) return -1;
 
         return 0;
     }
 }
 
-static int __write_fat(unsigned int cluster, unsigned int value) {
+static int __write_fat_unlocked(unsigned int cluster, unsigned int value) {
     for (unsigned int i = 0; i < FAT_data.table_count; i++) {
         unsigned int fat_i_first = FAT_data.first_fat_sector + i * FAT_data.fat_size;
         if (__write_fat_one(fat_i_first, cluster, value) != 0)
@@ -226,15 +271,136 @@ static int __write_fat(unsigned int cluster, unsigned int value) {
     return 0;
 }
 
+/*
+Allocation groups split the cluster space into FAT-sector aligned ranges.
+Every FAT entry of a cluster (in every FAT copy) lives in sectors owned by
+exactly one group, so the group lock is the lock for those cached sectors.
+Never hold two group locks at once.
+*/
+static alloc_group_t _alloc_groups[ALLOC_GROUPS_MAX];
+static unsigned int _alloc_group_count = 0;
+static unsigned int _alloc_group_size  = 0;
+static atomic_uint _alloc_group_rr;
+static _Thread_local int _thread_alloc_group = -1;
+
+static void _alloc_groups_init() {
+    static int locks_ready = 0;
+    if (!locks_ready) {
+        for (unsigned int g = 0; g < ALLOC_GROUPS_MAX; g++) pthread_mutex_init(&_alloc_groups[g].lock, NULL);
+        locks_ready = 1;
+    }
+
+    unsigned int per_sector  = FAT_data.bytes_per_sector / 4u;
+    unsigned int max_cluster = FAT_data.total_clusters + 2;
+    unsigned int size = (max_cluster + ALLOC_GROUPS_MAX - 1) / ALLOC_GROUPS_MAX;
+    if (size < ALLOC_GROUP_MIN_CLUSTERS) size = ALLOC_GROUP_MIN_CLUSTERS;
+    size = (size + per_sector - 1) / per_sector * per_sector;
+
+    _alloc_group_size  = size;
+    _alloc_group_count = (max_cluster + size - 1) / size;
+    for (unsigned int g = 0; g < _alloc_group_count; g++) {
+        alloc_group_t* ag = &_alloc_groups[g];
+        ag->start      = (g == 0) ? 2 : g * size;
+        ag->end        = MIN((g + 1) * size, max_cluster);
+        ag->cursor     = ag->start;
+        ag->free_count = -1;
+        ag->handles    = 0;
+    }
+
+    atomic_store(&_alloc_group_rr, 0);
+}
+
+static inline unsigned int _alloc_group_of(unsigned int cluster) {
+    unsigned int g = cluster / _alloc_group_size;
+    return (g < _alloc_group_count) ? g : _alloc_group_count - 1;
+}
+
+static inline void _fat_lock(unsigned int cluster) {
+    pthread_mutex_lock(&_alloc_groups[_alloc_group_of(cluster)].lock);
+}
+
+static inline void _fat_unlock(unsigned int cluster) {
+    pthread_mutex_unlock(&_alloc_groups[_alloc_group_of(cluster)].lock);
+}
+
+/* Writes every dirty FAT sector once, coalescing neighbours owned by the same group. */
+static int _fat_flush_dirty() {
+    if (!fat_dirty) return 0;
+
+    unsigned int per_sector = FAT_data.bytes_per_sector / 4u;
+    int result = 0;
+    for (unsigned int rel = 0; rel < fat_cache_sectors; rel++) {
+        if (!fat_dirty[rel]) continue;
+
+        unsigned int group = _alloc_group_of((rel % FAT_data.fat_size) * per_sector);
+        pthread_mutex_lock(&_alloc_groups[group].lock);
+
+        unsigned int count = 0;
+        while (rel + count < fat_cache_sectors && fat_dirty[rel + count] && fat_cache[rel + count] &&
+               _alloc_group_of(((rel + count) % FAT_data.fat_size) * per_sector) == group) count++;
+
+        /* Sectors stay dirty until they are on disk, so a failed run is retried by the next flush. */
+        unsigned char* run = malloc((size_t)count * SECTOR_SIZE);
+        if (run) {
+            for (unsigned int i = 0; i < count; i++) {
+                memcpy(run + (size_t)i * SECTOR_SIZE, fat_cache[rel + i], SECTOR_SIZE);
+            }
+
+            if (DSK_write_sectors(FAT_data.first_fat_sector + rel, run, count) == 1) {
+                memset(fat_dirty + rel, 0, count);
+            }
+            else {
+                result = -1;
+            }
+
+            free(run);
+        }
+        else {
+            result = -1;
+        }
+
+        pthread_mutex_unlock(&_alloc_groups[group].lock);
+        if (count > 0) rel += count - 1;
+    }
+
+    return result;
+}
+
+static inline void _fat_batch_begin() {
+    fat_batch_depth++;
+}
+
+static int _fat_batch_end() {
+    if (--fat_batch_depth > 0) return 0;
+    return _fat_flush_dirty();
+}
+
+static int __read_fat(unsigned int cluster) {
+    _fat_lock(cluster);
+    int v = __read_fat_unlocked(cluster);
+    _fat_unlock(cluster);
+    return v;
+}
+
+static int __write_fat(unsigned int cluster, unsigned int value) {
+    _fat_lock(cluster);
+    int rc = __write_fat_unlocked(cluster, value);
+    _fat_unlock(cluster);
+    return rc;
+}
+
 void fat_cache_free_all() {
     if (!fat_cache) return;
 
-    for (unsigned int i = 0; i < FAT_data.fat_size; i++) {
+    for (unsigned int i = 0; i < fat_cache_sectors; i++) {
         if (fat_cache[i]) free(fat_cache[i]);
     }
 
     free(fat_cache);
+    free(fat_dirty);
     fat_cache = NULL;
+    fat_dirty = NULL;
+    fat_cache_sectors = 0;
 }
 
 static inline int _is_cluster_free(unsigned int cluster) {
@@ -262,65 +428,205 @@ static inline int _is_cluster_bad(unsigned int cluster, int fatType) {
 	return 0;
 }
 
-static unsigned int _cluster_allocate() {
-    unsigned int max_cluster = FAT_data.total_clusters + 1; 
-    if (max_cluster < 2) return 0;
+/* Counts free clusters of a group the first time it is used. Caller holds the group lock. */
+static int _alloc_group_summarize(alloc_group_t* ag) {
+    if (ag->free_count >= 0) return 0;
 
-    unsigned int start = last_allocated_cluster;
-    if (start < 2 || start > max_cluster) start = 2;
+    int free_count = 0;
+    for (unsigned int c = ag->start; c < ag->end; c++) {
+        int st = __read_fat_unlocked(c);
+        if (st < 0) return -1;
+        if ((unsigned int)st == FREE_CLUSTER_32) free_count++;
+    }
 
+    ag->free_count = free_count;
+    return 0;
+}
 
-    for (unsigned int c = start; c <= max_cluster; c++) {
-        int st = __read_fat(c);
-        if (st < 0) return 0;
-        if ((unsigned int)st == FREE_CLUSTER_32) {
-            if (_set_cluster_end(c, FAT_data.fat_type) == 0) {
-                last_allocated_cluster = c + 1;
-                if (last_allocated_cluster > max_cluster) last_allocated_cluster = 2;
-                return c;
-            }
-            return 0;
-        }
+static unsigned int _alloc_group_take(unsigned int group) {
+    alloc_group_t* ag = &_alloc_groups[group];
+    unsigned int result = 0;
+
+    pthread_mutex_lock(&ag->lock);
+    if (_alloc_group_summarize(ag) != 0 || ag->free_count == 0) {
+        pthread_mutex_unlock(&ag->lock);
+        return 0;
     }
 
-    for (unsigned int c = 2; c < start; c++) {
-        int st = __read_fat(c);
-        if (st < 0) return 0;
+    unsigned int start = ag->cursor;
+    if (start < ag->start || start >= ag->end) start = ag->start;
+
+    unsigned int c = start;
+    do {
+        int st = __read_fat_unlocked(c);
+        if (st < 0) break;
         if ((unsigned int)st == FREE_CLUSTER_32) {
-            if (_set_cluster_end(c, FAT_data.fat_type) == 0) {
-                last_allocated_cluster = c + 1;
-                if (last_allocated_cluster > max_cluster) last_allocated_cluster = 2;
-                return c;
+            if (__write_fat_unlocked(c, END_CLUSTER_32) == 0) {
+                ag->free_count--;
+                ag->cursor = (c + 1 < ag->end) ? c + 1 : ag->start;
+                result = c;
             }
-            return 0;
+            break;
+        }
+
+        if (++c >= ag->end) c = ag->start;
+    } while (c != start);
+
+    pthread_mutex_unlock(&ag->lock);
+    return result;
+}
+
+/* Allocates from the preferred group, then spills to its neighbours: g, g+1, g-1, g+2, ... */
+static unsigned int _cluster_allocate_in(unsigned int group, unsigned int* used_group) {
+    if (_alloc_group_count == 0) return 0;
+    if (group >= _alloc_group_count) group = 0;
+
+    for (unsigned int step = 0; step < 2 * _alloc_group_count; step++) {
+        unsigned int distance = (step + 1) / 2;
+        long g = (step % 2) ? (long)group + distance : (long)group - distance;
+        if (g < 0 || g >= (long)_alloc_group_count) continue;
+
+        unsigned int c = _alloc_group_take((unsigned int)g);
+        if (c) {
+            if (used_group) *used_group = (unsigned int)g;
+            return c;
         }
     }
+
     return 0;
 }
 
+static unsigned int _thread_group() {
+    if (_thread_alloc_group < 0) {
+        _thread_alloc_group = (int)(atomic_fetch_add(&_alloc_group_rr, 1) % _alloc_group_count);
+    }
+
+    return (unsigned int)_thread_alloc_group;
+}
+
+static unsigned int _cluster_allocate() {
+    return _cluster_allocate_in(_thread_group(), NULL);
+}
+
+/*
+A handle starts in the group of its last cluster if no other handle owns it,
+otherwise in the next unowned (or least shared) group.
+*/
+static int _alloc_group_claim(unsigned int last_cluster) {
+    unsigned int home = _alloc_group_of(last_cluster);
+    alloc_group_t* ag = &_alloc_groups[home];
+
+    pthread_mutex_lock(&ag->lock);
+    if (ag->handles == 0) {
+        ag->handles++;
+        if (last_cluster + 1 < ag->end) ag->cursor = last_cluster + 1;
+        pthread_mutex_unlock(&ag->lock);
+        return (int)home;
+    }
+    pthread_mutex_unlock(&ag->lock);
+
+    unsigned int first = atomic_fetch_add(&_alloc_group_rr, 1) % _alloc_group_count;
+    unsigned int best  = first;
+    for (unsigned int i = 0; i < _alloc_group_count; i++) {
+        unsigned int g = (first + i) % _alloc_group_count;
+        if (_alloc_groups[g].handles < _alloc_groups[best].handles) best = g;
+        if (_alloc_groups[best].handles == 0) break;
+    }
+
+    pthread_mutex_lock(&_alloc_groups[best].lock);
+    _alloc_groups[best].handles++;
+    pthread_mutex_unlock(&_alloc_groups[best].lock);
+    return (int)best;
+}
+
+static void _alloc_group_release(int group) {
+    if (group < 0 || (unsigned int)group >= _alloc_group_count) return;
+    pthread_mutex_lock(&_alloc_groups[group].lock);
+    if (_alloc_groups[group].handles > 0) _alloc_groups[group].handles--;
+    pthread_mutex_unlock(&_alloc_groups[group].lock);
+}
+
 static int _cluster_deallocate(const unsigned int cluster) {
-	int cluster_status = __read_fat(cluster);
-	if (_is_cluster_free(cluster_status) == 1) return 0;
+	alloc_group_t* ag = &_alloc_groups[_alloc_group_of(cluster)];
+	pthread_mutex_lock(&ag->lock);
+
+	int cluster_status = __read_fat_unlocked(cluster);
+	if (_is_cluster_free(cluster_status) == 1) {
+		pthread_mutex_unlock(&ag->lock);
+		return 0;
+	}
 	else if (cluster_status < 0) {
+		pthread_mutex_unlock(&ag->lock);
 		printf("Function _cluster_deallocate: Error occurred with __read_fat, aborting operations...\n");
 		return -1;
 	}
 
-	if (_set_cluster_free(cluster) == 0) return 0;
+	if (__write_fat_unlocked(cluster, FREE_CLUSTER_32) == 0) {
+		if (ag->free_count >= 0) ag->free_count++;
+		pthread_mutex_unlock(&ag->lock);
+		return 0;
+	}
 	else {
+		pthread_mutex_unlock(&ag->lock);
 		printf("Function _cluster_deallocate: Error occurred with __write_fat, aborting operations...\n");
 		return -1;
 	}
 }
 
-static unsigned char* _cluster_readoff(unsigned int cluster, unsigned int offset) {
-	unsigned int start_sect = (cluster - 2) * (unsigned short)FAT_data.sectors_per_cluster + FAT_data.first_data_sector;
-	unsigned char* cluster_data = DSK_readoff_sectors(start_sect, offset, FAT_data.sectors_per_cluster);
-	return cluster_data;
+/* First-fit search of a free run of count clusters, starting at hint and wrapping around once. */
+static int _cluster_find_free_run(unsigned int count, unsigned int hint, unsigned int* first) {
+	unsigned int max_cluster = FAT_data.total_clusters + 2;
+	if (count == 0) return -2;
+	if (hint < 2 || hint >= max_cluster) hint = 2;
+
+	for (int pass = 0; pass < 2; pass++) {
+		unsigned int from = pass ? 2 : hint;
+		unsigned int to   = pass ? MIN(hint + count, max_cluster) : max_cluster;
+		if (pass && hint == 2) break;
+
+		unsigned int run = 0;
+		for (unsigned int c = from; c < to; c++) {
+			int st = __read_fat(c);
+			if (st < 0) return -1;
+
+			run = ((unsigned int)st == FREE_CLUSTER_32) ? run + 1 : 0;
+			if (run == count) {
+				*first = c + 1 - count;
+				return 0;
+			}
+		}
+	}
+
+	return -2;
+}
+
+/* Links [first, first + count) into one chain, or rolls back if someone took a cluster meanwhile. */
+static int _cluster_claim_run(unsigned int first, unsigned int count) {
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int c = first + i;
+		alloc_group_t* ag = &_alloc_groups[_alloc_group_of(c)];
+
+		pthread_mutex_lock(&ag->lock);
+		int st = __read_fat_unlocked(c);
+		int ok = (st == FREE_CLUSTER_32) && __write_fat_unlocked(c, (i + 1 < count) ? c + 1 : END_CLUSTER_32) == 0;
+		if (ok && ag->free_count > 0) ag->free_count--;
+		pthread_mutex_unlock(&ag->lock);
+
+		if (!ok) {
+			for (unsigned int j = 0; j < i; j++) _cluster_deallocate(first + j);
+			return -1;
+		}
+	}
+
+	return 0;
 }
 
-static unsigned char* _cluster_read(unsigned int cluster) {
-	return _cluster_readoff(cluster, 0);
+static void _chain_free(unsigned int cluster) {
+	while (cluster >= 2 && cluster < END_CLUSTER_32) {
+		int next = __read_fat(cluster);
+		if (next < 0 || _cluster_deallocate(cluster) != 0) return;
+		cluster = (unsigned int)next;
+	}
 }
 
 static int _cluster_write(const unsigned char* data, unsigned int cluster) {
@@ -333,6 +639,70 @@ static int _cluster_writeoff(const unsigned char* data, unsigned int cluster, un
 	return (DSK_writeoff_sectors(start_sect, data, FAT_data.sectors_per_cluster, offset, size) == 1) ? 0 : -1;
 }
 
+/* Writes size bytes at offset into a run of count physically consecutive clusters. */
+static int _cluster_run_write(const unsigned char* data, unsigned int cluster, unsigned int count, unsigned int offset, unsigned int size) {
+	unsigned int start_sect = (cluster - 2) * (unsigned short)FAT_data.sectors_per_cluster + FAT_data.first_data_sector;
+	return (DSK_writeoff_sectors(start_sect, data, count * FAT_data.sectors_per_cluster, offset, size) == 1) ? 0 : -1;
+}
+
+/* Writes count directory entries starting at slot index; only the sectors holding them are touched. */
+static int _directory_slots_write(unsigned int cluster, unsigned int index, const directory_entry_t* entries, unsigned int count) {
+	return _cluster_writeoff((const unsigned char*)entries, cluster, index * sizeof(directory_entry_t), count * sizeof(directory_entry_t));
+}
+
+static inline int _directory_slot_write(unsigned int cluster, unsigned int index, const directory_entry_t* entry) {
+	return _directory_slots_write(cluster, index, entry, 1);
+}
+
+static void _dir_window_open(dir_window_t* window, unsigned int cluster) {
+	memset(window, 0, sizeof(dir_window_t));
+	window->next = cluster;
+}
+
+/*
+Loads the next DIR_READ_WINDOW clusters of a directory chain back to back.
+The chain is resolved from the FAT first and each physically contiguous run
+is one read. Returns the number of clusters loaded, 0 at the end, -1 on error.
+*/
+static int _dir_window_fill(dir_window_t* window) {
+	unsigned int count = 0;
+	while (count < DIR_READ_WINDOW && window->next >= 2 && !_is_cluster_end(window->next, FAT_data.fat_type)) {
+		if (++window->total > FAT_data.total_clusters) return -1;
+		window->clusters[count++] = window->next;
+
+		int next = __read_fat(window->next);
+		if (next < 0) return -1;
+		window->next = (unsigned int)next;
+	}
+
+	window->count = 0;
+	if (!count) return 0;
+
+	if (window->capacity < count) {
+		unsigned char* data = realloc(window->data, (size_t)count * FAT_data.cluster_size);
+		if (!data) return -1;
+		window->data     = data;
+		window->capacity = count;
+	}
+
+	for (unsigned int i = 0; i < count; ) {
+		unsigned int run = 1;
+		while (i + run < count && window->clusters[i + run] == window->clusters[i] + run) run++;
+
+		unsigned int sector = (window->clusters[i] - 2) * (unsigned short)FAT_data.sectors_per_cluster + FAT_data.first_data_sector;
+		if (!DSK_read_sectors_into(sector, run * FAT_data.sectors_per_cluster, window->data + (size_t)i * FAT_data.cluster_size)) return -1;
+		i += run;
+	}
+
+	window->count = count;
+	return (int)count;
+}
+
+static void _dir_window_close(dir_window_t* window) {
+	free(window->data);
+	memset(window, 0, sizeof(dir_window_t));
+}
+
 static int _copy_cluster2cluster(unsigned int source, unsigned int destination) {
 	unsigned int first = (source - 2) * (unsigned short)FAT_data.sectors_per_cluster + FAT_data.first_data_sector;
 	unsigned int second = (destination - 2) * (unsigned short)FAT_data.sectors_per_cluster + FAT_data.first_data_sector;
@@ -344,9 +714,15 @@ static void _add_cluster_to_content(int ci) {
     if (!c || !c->file || !c->file->data || c->file->data_size <= 0) return;
 
     unsigned int last = c->file->data[c->file->data_size - 1];
+    if (c->alloc_group < 0) c->alloc_group = _alloc_group_claim(last);
 
-    unsigned int newc = _cluster_allocate();
+    unsigned int used_group = (unsigned int)c->alloc_group;
+    unsigned int newc = _cluster_allocate_in((unsigned int)c->alloc_group, &used_group);
     if (newc == 0) return;
+    if ((int)used_group != c->alloc_group) {
+        _alloc_group_release(c->alloc_group);
+        c->alloc_group = _alloc_group_claim(newc);
+    }
 
     if (__write_fat(last, newc) != 0) return;
     _set_cluster_end(newc, FAT_data.fat_type);
@@ -357,37 +733,19 @@ static void _add_cluster_to_content(int ci) {
     nd[c->file->data_size] = newc;
     c->file->data = nd;
     c->file->data_size += 1;
-
-    unsigned char* zero = calloc(1, FAT_data.sectors_per_cluster * SECTOR_SIZE);
-    if (zero) {
-        _cluster_write(zero, newc);
-        free(zero);
-    }
 }
 
-static int _cluster_read_range(unsigned int cluster, unsigned int offset, unsigned char* out, unsigned int size) {
-    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
-    if (offset + size > cluster_bytes) return -1;
-
-    unsigned int sector_off = offset / SECTOR_SIZE;
-    unsigned int byte_off   = offset % SECTOR_SIZE;
-
-    unsigned int need_sectors = (byte_off + size + SECTOR_SIZE - 1) / SECTOR_SIZE;
-    if (sector_off + need_sectors > FAT_data.sectors_per_cluster) return -1;
-
-    unsigned int lba = (cluster - 2) * FAT_data.sectors_per_cluster + FAT_data.first_data_sector + sector_off;
-
-    unsigned char* tmp = DSK_readoff_sectors(lba, byte_off, need_sectors);
-    if (!tmp) return -1;
-
-    memcpy(out, tmp, size);
-    free(tmp);
-    return 0;
+/* Reads size bytes at offset into a run of physically consecutive clusters straight into out. */
+static int _cluster_run_read(unsigned int cluster, unsigned int offset, unsigned char* out, unsigned int size) {
+    unsigned int lba = (cluster - 2) * FAT_data.sectors_per_cluster + FAT_data.first_data_sector;
+    return DSK_read_bytes_into(lba, offset, size, out) ? 0 : -1;
 }
 
 int FAT_directory_list(int ci, unsigned char attrs, int exclusive) {
-	unsigned int cluster = GET_CLUSTER_FROM_ENTRY(FAT_get_content_from_table(ci)->meta, FAT_data.fat_type);
-	
+	Content* source = FAT_get_content_from_table(ci);
+	if (!source) return -1;
+	unsigned int cluster = GET_CLUSTER_FROM_ENTRY(source->meta, FAT_data.fat_type);
+
 	Content* content = FAT_create_content();
 	if (!content) return 0;
 
@@ -402,82 +760,66 @@ int FAT_directory_list(int ci, unsigned char attrs, int exclusive) {
 	if (exclusive == 0) attributes_to_hide &= (~attrs);
 	else if (exclusive == 1) attributes_to_hide = (~attrs);
 
-	unsigned char* cluster_data = _cluster_read(cluster);
-	if (cluster_data == NULL) {
-		printf("Function FAT_directory_list: _cluster_read encountered an error. Aborting...\n");
+	DirIter_t it;
+	if (FAT_directory_open_cluster(cluster, &it) != 0) {
+		printf("Function FAT_directory_list: FAT_directory_open_cluster encountered an error. Aborting...\n");
 		FAT_unload_content_system(content);
 		return -1;
 	}
 
-	directory_entry_t* file_metadata = (directory_entry_t*)cluster_data;
-	unsigned int meta_pointer_iterator_count = 0;
-	while (1) {
-		if (file_metadata->file_name[0] == ENTRY_END) break;
-		else if (strncmp((char*)file_metadata->file_name, "..", 2) == 0 ||
-				strncmp((char*)file_metadata->file_name, ".", 1) == 0) {
-			file_metadata++;
-			meta_pointer_iterator_count++;
-		}
-		else if (((file_metadata->file_name)[0] == ENTRY_FREE) || ((file_metadata->attributes & FILE_LONG_NAME) == FILE_LONG_NAME)) {	
-			if (meta_pointer_iterator_count < FAT_data.cluster_size / sizeof(directory_entry_t) - 1) {
-				file_metadata++;
-				meta_pointer_iterator_count++;
-			}
-			else {
-				int next_cluster = __read_fat(cluster);
-				if (_is_cluster_end(next_cluster, FAT_data.fat_type) == 1) break;
-				else if (next_cluster < 0) {
-					printf("Function FAT_directory_list: __read_fat encountered an error. Aborting...\n");
-					FAT_unload_content_system(content);
-					return -1;
-				}
-				else {
-					FAT_unload_content_system(content);
-					return FAT_directory_list(next_cluster, attrs, exclusive);
-				}
+	File* files_tail = NULL;
+	Directory* directories_tail = NULL;
+
+	DirEntry_t item;
+	int result = 0;
+	while ((result = FAT_directory_next(&it, &item)) == 1) {
+		if (item.name[0] == '.') continue;
+		if (item.entry.attributes & attributes_to_hide) continue;
+
+		if ((item.entry.attributes & FILE_DIRECTORY) != FILE_DIRECTORY) {
+			File* file = _create_file();
+			if (!file) {
+				result = -1;
+				break;
 			}
+
+			char* dot = strchr(item.name, '.');
+			if (dot) *dot = 0;
+			strncpy(file->name, item.name, sizeof(file->name) - 1);
+			file->name[sizeof(file->name) - 1] = 0;
+			strncpy(file->extension, dot ? dot + 1 : "", sizeof(file->extension) - 1);
+			file->extension[sizeof(file->extension) - 1] = 0;
+
+			if (files_tail == NULL) content->directory->files = file;
+			else files_tail->next = file;
+			files_tail = file;
 		}
 		else {
-			if ((file_metadata->attributes & FILE_DIRECTORY) != FILE_DIRECTORY) {			
-				File* file = _create_file();
-
-				char name[13] = { 0 };
-				strcpy(name, (const char*)file_metadata->file_name);
-				strcpy(file->name, (const char*)strtok(name, " "));
-				strcpy(file->extension, (const char*)strtok(NULL, " "));
-
-				if (content->directory->files == NULL) content->directory->files = file;
-				else {
-					File* current = content->directory->files;
-					while (current->next != NULL) current = current->next;
-					current->next = file;
-				}
-			}
-			else {
-				if ((file_metadata->attributes & FILE_DIRECTORY) == FILE_DIRECTORY) {
-					Directory* upperDir = _create_directory();
-
-					char name[13] = { 0 };
-					strcpy(name, (char*)file_metadata->file_name);
-					strncpy(upperDir->name, strtok(name, " "), 11);
-					
-					if (content->directory->subDirectory == NULL) content->directory->subDirectory = upperDir;
-					else {
-						Directory* current = content->directory->subDirectory;
-						while (current->next != NULL) current = current->next;
-						current->next = upperDir;
-					}
-				}
+			Directory* upperDir = _create_directory();
+			if (!upperDir) {
+				result = -1;
+				break;
 			}
 
-			file_metadata++;
-			meta_pointer_iterator_count++;
+			strncpy(upperDir->name, item.name, sizeof(upperDir->name) - 1);
+			upperDir->name[sizeof(upperDir->name) - 1] = 0;
+
+			if (directories_tail == NULL) content->directory->subDirectory = upperDir;
+			else directories_tail->next = upperDir;
+			directories_tail = upperDir;
 		}
 	}
 
+	FAT_directory_close(&it);
+	if (result < 0) {
+		printf("Function FAT_directory_list: FAT_directory_next encountered an error. Aborting...\n");
+		FAT_unload_content_system(content);
+		return -1;
+	}
+
 	int root_ci = _add_content2table(content);
 	if (root_ci == -1) {
-		printf("Function FAT_open_content: an error occurred in _add_content2table. Aborting...\n");
+		printf("Function FAT_directory_list: an error occurred in _add_content2table. Aborting...\n");
 		FAT_unload_content_system(content);
 		return -1;
 	}
@@ -485,640 +827,4004 @@ int FAT_directory_list(int ci, unsigned char attrs, int exclusive) {
 	return root_ci;
 }
 
-static int _directory_search(const char* filepart, const unsigned int cluster, directory_entry_t* file, unsigned int* entryOffset) {
-	char searchName[13] = { 0 };
-	strcpy(searchName, filepart);
-	if (_name_check(searchName)) {
-		_name2fatname(searchName);
+static unsigned char _lfn_checksum(const unsigned char* short_name) {
+	unsigned char sum = 0;
+	for (int i = 0; i < 11; i++) sum = (unsigned char)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+	return sum;
+}
+
+/* Case-folded FNV-1a of a long name; ASCII letters fold, other bytes hash as they are. */
+static unsigned int _lfn_hash(const char* name) {
+	unsigned int hash = 2166136261u;
+	for (; *name; name++) {
+		hash ^= (unsigned char)toupper((unsigned char)*name);
+		hash *= 16777619u;
 	}
 
-	unsigned char* cluster_data = _cluster_read(cluster);
-	if (cluster_data == NULL) {
-		printf("Function _directory_search: _cluster_read encountered an error. Aborting...\n");
-		return -1;
+	return hash;
+}
+
+static int _lfn_equal(const char* first, const char* second) {
+	for (; *first && *second; first++, second++) {
+		if (toupper((unsigned char)*first) != toupper((unsigned char)*second)) return 0;
 	}
 
-	directory_entry_t* file_metadata = (directory_entry_t*)cluster_data;
-	unsigned int meta_pointer_iterator_count = 0;
-	while (1) {
-		if (file_metadata->file_name[0] == ENTRY_END) break;
-		else if (strncmp((char*)file_metadata->file_name, searchName, 11) != 0) {
-			if (meta_pointer_iterator_count < FAT_data.cluster_size / sizeof(directory_entry_t) - 1) {
-				file_metadata++;
-				meta_pointer_iterator_count++;
-			}
-			else {
-				int next_cluster = __read_fat(cluster);
-				if (_is_cluster_end(next_cluster, FAT_data.fat_type) == 1) break;
-				else if (next_cluster < 0) {
-					printf("Function _directory_search: __read_fat encountered an error. Aborting...\n");
-					free(cluster_data);
-					return -1;
-				} 
-				else {
-					free(cluster_data);
-					return _directory_search(filepart, next_cluster, file, entryOffset);
-				}
-			}
+	return *first == *second;
+}
+
+/* Returns the UTF-16 length of a UTF-8 name, 0 if it is malformed or longer than max. */
+static unsigned int _utf8_to_utf16(const char* input, unsigned short* output, unsigned int max) {
+	const unsigned char* p = (const unsigned char*)input;
+	unsigned int length = 0;
+	while (*p) {
+		unsigned int code = 0, extra = 0;
+		if (*p < 0x80)                { code = *p; extra = 0; }
+		else if ((*p & 0xE0) == 0xC0) { code = *p & 0x1F; extra = 1; }
+		else if ((*p & 0xF0) == 0xE0) { code = *p & 0x0F; extra = 2; }
+		else if ((*p & 0xF8) == 0xF0) { code = *p & 0x07; extra = 3; }
+		else return 0;
+
+		p++;
+		for (unsigned int i = 0; i < extra; i++, p++) {
+			if ((*p & 0xC0) != 0x80) return 0;
+			code = (code << 6) | (*p & 0x3F);
 		}
-		else {
-			if (file != NULL) memcpy(file, file_metadata, sizeof(directory_entry_t));
-			if (entryOffset != NULL) *entryOffset = meta_pointer_iterator_count;
 
-			free(cluster_data);
-			return 0;
+		if (code >= 0x10000) {
+			if (length + 2 > max) return 0;
+			code -= 0x10000;
+			output[length++] = (unsigned short)(0xD800 | (code >> 10));
+			output[length++] = (unsigned short)(0xDC00 | (code & 0x3FF));
+		}
+		else {
+			if (length + 1 > max) return 0;
+			output[length++] = (unsigned short)code;
 		}
 	}
 
-	free(cluster_data);
-	return -2;
+	return length;
 }
 
-static int _directory_add(const unsigned int cluster, directory_entry_t* file_to_add) {
-	unsigned char* cluster_data = _cluster_read(cluster);
-	if (cluster_data == NULL) {
-		printf("Function _directory_add: _cluster_read encountered an error. Aborting...\n");
-		return -1;
-	}
+static void _utf16_to_utf8(const unsigned short* input, unsigned int length, char* output, size_t outsz) {
+	size_t at = 0;
+	for (unsigned int i = 0; i < length && input[i] != 0x0000 && input[i] != 0xFFFF; i++) {
+		unsigned int code = input[i];
+		if (code >= 0xD800 && code < 0xDC00 && i + 1 < length && input[i + 1] >= 0xDC00 && input[i + 1] < 0xE000) {
+			code = 0x10000 + ((code - 0xD800) << 10) + (input[++i] - 0xDC00);
+		}
 
-	directory_entry_t* file_metadata = (directory_entry_t*)cluster_data;
-	unsigned int meta_pointer_iterator_count = 0;
-	while (1) {
-		if (file_metadata->file_name[0] != ENTRY_FREE && file_metadata->file_name[0] != ENTRY_END) {
-			if (meta_pointer_iterator_count < FAT_data.cluster_size / sizeof(directory_entry_t) - 1) {
-				file_metadata++;
-				meta_pointer_iterator_count++;
-			}
-			else {
-				unsigned int next_cluster = __read_fat(cluster);
-				if (_is_cluster_end(next_cluster, FAT_data.fat_type) == 1) {
-					next_cluster = _cluster_allocate();
-					if (_is_cluster_bad(next_cluster, FAT_data.fat_type) == 1) {
-						printf("Function _directory_add: allocation of new cluster failed. Aborting...\n");
-						free(cluster_data);
-						return -1;
-					}
-
-					if (__write_fat(cluster, next_cluster) != 0) {
-						printf("Function _directory_add: extension of the cluster chain with new cluster failed. Aborting...\n");
-						free(cluster_data);
-						return -1;
-					}
-				}
+		unsigned char bytes[4];
+		size_t count = 0;
+		if (code < 0x80)         { bytes[0] = (unsigned char)code; count = 1; }
+		else if (code < 0x800)   { bytes[0] = (unsigned char)(0xC0 | (code >> 6)); bytes[1] = (unsigned char)(0x80 | (code & 0x3F)); count = 2; }
+		else if (code < 0x10000) { bytes[0] = (unsigned char)(0xE0 | (code >> 12)); bytes[1] = (unsigned char)(0x80 | ((code >> 6) & 0x3F)); bytes[2] = (unsigned char)(0x80 | (code & 0x3F)); count = 3; }
+		else                     { bytes[0] = (unsigned char)(0xF0 | (code >> 18)); bytes[1] = (unsigned char)(0x80 | ((code >> 12) & 0x3F)); bytes[2] = (unsigned char)(0x80 | ((code >> 6) & 0x3F)); bytes[3] = (unsigned char)(0x80 | (code & 0x3F)); count = 4; }
 
-				free(cluster_data);
-				return _directory_add(next_cluster, file_to_add);
-			}
-		}
-		else {
-			file_to_add->creation_date 			= DTM_current_date();
-			file_to_add->creation_time 			= DTM_current_time();
-			file_to_add->creation_time_tenths 	= DTM_current_time();
-			file_to_add->last_accessed 			= file_to_add->creation_date;
-			file_to_add->last_modification_date = file_to_add->creation_date;
-			file_to_add->last_modification_time = file_to_add->creation_time;
-
-			unsigned int new_cluster = _cluster_allocate();
-			if (_is_cluster_bad(new_cluster, FAT_data.fat_type) == 1) {
-				printf("Function _directory_add: allocation of new cluster failed. Aborting...\n");
-				free(cluster_data);
+		if (at + count >= outsz) break;
+		memcpy(output + at, bytes, count);
+		at += count;
+	}
 
-				return -1;
-			}
-			
-			file_to_add->low_bits  = GET_ENTRY_LOW_BITS(new_cluster, FAT_data.fat_type);
-			file_to_add->high_bits = GET_ENTRY_HIGH_BITS(new_cluster, FAT_data.fat_type);
+	output[at] = 0;
+}
 
-			memcpy(file_metadata, file_to_add, sizeof(directory_entry_t));
-			if (_cluster_write(cluster_data, cluster) != 0) {
-				printf("Function _directory_add: Writing new directory entry failed. Aborting...\n");
-				free(cluster_data);
-				return -1;
-			}
+static inline void _lfn_reset(lfn_state_t* state) {
+	state->next  = 0;
+	state->count = 0;
+}
 
-			free(cluster_data);
-			return 0;
-		}
+/* Collects one LFN slot; a slot out of sequence drops what was gathered so far. */
+static void _lfn_feed(lfn_state_t* state, const directory_entry_t* slot, unsigned int cluster, unsigned int index) {
+	const lfn_entry_t* lfn = (const lfn_entry_t*)slot;
+	unsigned int order = lfn->order & LFN_ORDER_MASK;
+	if (lfn->order & LFN_LAST) {
+		_lfn_reset(state);
+		if (order == 0 || order > LFN_MAX_SLOTS) return;
+
+		state->count         = order;
+		state->checksum      = lfn->checksum;
+		state->first_cluster = cluster;
+		state->first_index   = index;
+	}
+	else if (!state->count || order == 0 || order != state->next || lfn->checksum != state->checksum) {
+		_lfn_reset(state);
+		return;
 	}
 
-	free(cluster_data);
-	return -1;
+	unsigned short* chars = &state->chars[(order - 1) * LFN_CHARS];
+	for (int i = 0; i < 5; i++) chars[i]      = lfn->name1[i];
+	for (int i = 0; i < 6; i++) chars[5 + i]  = lfn->name2[i];
+	for (int i = 0; i < 2; i++) chars[11 + i] = lfn->name3[i];
+	state->next = order - 1;
 }
 
-static int _directory_edit(const unsigned int cluster, directory_entry_t* old_meta, const char* new_name) {
-	if (_name_check((char*)old_meta->file_name) != 0) {
-		printf("Function _directory_edit: Invalid file name!");
-		return -1;
-	}
+/* Hands out the long name of the 8.3 entry that closes a sequence, if the sequence is whole and its checksum matches. */
+static int _lfn_take(lfn_state_t* state, const directory_entry_t* entry, char* output, size_t outsz) {
+	int valid = state->count && state->next == 0 && state->checksum == _lfn_checksum(entry->file_name);
+	if (valid) _utf16_to_utf8(state->chars, state->count * LFN_CHARS, output, outsz);
+	else output[0] = 0;
+	return valid;
+}
 
-	unsigned char* cluster_data = _cluster_read(cluster);
-	if (cluster_data == NULL) {
-		printf("Function _directory_edit: _cluster_read encountered an error. Aborting...\n");
-		return -1;
+static void _lfn_fill(directory_entry_t* slot, unsigned int order, int last, unsigned char checksum, const unsigned short* units, unsigned int length) {
+	lfn_entry_t* lfn = (lfn_entry_t*)slot;
+	memset(lfn, 0, sizeof(lfn_entry_t));
+	lfn->order      = (unsigned char)(order | (last ? LFN_LAST : 0));
+	lfn->attributes = FILE_LONG_NAME;
+	lfn->checksum   = checksum;
+
+	unsigned short chars[LFN_CHARS];
+	for (unsigned int i = 0; i < LFN_CHARS; i++) {
+		unsigned int at = (order - 1) * LFN_CHARS + i;
+		chars[i] = at < length ? units[at] : (at == length ? 0x0000 : 0xFFFF);
 	}
 
-	directory_entry_t* file_metadata = (directory_entry_t*)cluster_data;
-	unsigned int meta_pointer_iterator_count = 0;
-	while (1) {
-		if (memcmp(file_metadata->file_name, old_meta->file_name, 11) == 0) {
-
-			old_meta->last_accessed = DTM_current_date();
-			old_meta->last_modification_date = DTM_current_date();
-			old_meta->last_modification_time = DTM_current_time();
+	for (int i = 0; i < 5; i++) lfn->name1[i] = chars[i];
+	for (int i = 0; i < 6; i++) lfn->name2[i] = chars[5 + i];
+	for (int i = 0; i < 2; i++) lfn->name3[i] = chars[11 + i];
+}
 
-			memset(old_meta->file_name, 0, 11);
-			strncpy((char*)old_meta->file_name, new_name, 11);
-			memcpy(file_metadata, old_meta, sizeof(directory_entry_t));
-			
-			if (_cluster_write(cluster_data, cluster) != 0) {
-				printf("Function _directory_edit: Writing updated directory entry failed. Aborting...\n");
-				free(cluster_data);
-				return -1;
-			}
+/* A name needs LFN slots when it can not be stored as 8.3; case alone does not count. */
+static int _lfn_needed(const char* name) {
+	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
 
-			return 0;
-		} 
-		
-		else if (meta_pointer_iterator_count < FAT_data.cluster_size / sizeof(directory_entry_t) - 1)  {
-			file_metadata++;
-			meta_pointer_iterator_count++;
-		} 
-		
-		else {
-			unsigned int next_cluster = __read_fat(cluster);
-			if ((next_cluster >= END_CLUSTER_32 && FAT_data.fat_type == 32) || (next_cluster >= END_CLUSTER_16 && FAT_data.fat_type == 16) || (next_cluster >= END_CLUSTER_12 && FAT_data.fat_type == 12)) {
-				printf("Function _directory_edit: End of cluster chain reached. File not found. Aborting...\n");
-				free(cluster_data);
-				return -2;
-			}
+	const char* dot = strrchr(name, '.');
+	size_t base = dot ? (size_t)(dot - name) : strlen(name);
+	size_t ext  = dot ? strlen(dot + 1) : 0;
+	if (base == 0 || base > 8 || ext > 3 || (dot && ext == 0)) return 1;
 
-			free(cluster_data);
-			return _directory_edit(next_cluster, old_meta, new_name);
-		}
+	for (const char* p = name; *p; p++) {
+		unsigned char c = (unsigned char)*p;
+		if (c == '.' && p != dot) return 1;
+		if (c == ' ' || c >= 0x80 || strchr("+,;=[]", c)) return 1;
 	}
 
-	free(cluster_data);
-	return -1;
+	return 0;
 }
 
-static int _directory_remove(const unsigned int cluster, const char* fileName) {
-	if (_name_check(fileName) != 0) {
-		printf("Function _directory_remove: Invalid file name!");
-		return -1;
+static int _lfn_valid(const char* name) {
+	size_t length = strlen(name);
+	if (length == 0 || length > LFN_UTF8_MAX) return 0;
+	for (const char* p = name; *p; p++) {
+		if ((unsigned char)*p < 0x20 || strchr("\"*/:<>?\\|", *p)) return 0;
 	}
 
-	unsigned char* cluster_data = _cluster_read(cluster);
-	if (cluster_data == NULL) {
-		printf("Function _directory_remove: _cluster_read encountered an error. Aborting...\n");
-		return -1;
+	return 1;
+}
+
+static dir_index_t _dir_indexes[DIR_INDEX_MAX];
+static unsigned int _dir_index_clock = 0;
+
+static inline unsigned int _dir_name_hash(const unsigned char* name) {
+	unsigned int hash = 2166136261u;
+	for (int i = 0; i < 11; i++) {
+		hash ^= name[i];
+		hash *= 16777619u;
 	}
 
-	directory_entry_t* file_metadata = (directory_entry_t*)cluster_data;
-	unsigned int meta_pointer_iterator_count = 0;
-	while (1) {
-		if (memcmp(file_metadata->file_name, fileName, 11) == 0) {
-			file_metadata->file_name[0] = ENTRY_FREE;
-			if (_cluster_write(cluster_data, cluster) != 0) {
-				printf("Function _directory_remove: Writing updated directory entry failed. Aborting...\n");
-				free(cluster_data);
-				return -1;
-			}
+	return hash;
+}
 
-			return 0;
-		} 
-		else if (meta_pointer_iterator_count < FAT_data.cluster_size / sizeof(directory_entry_t) - 1)  {
-			file_metadata++;
-			meta_pointer_iterator_count++;
-		} 
-		else {
-			unsigned int next_cluster = __read_fat(cluster);
-			if ((next_cluster >= END_CLUSTER_32 && FAT_data.fat_type == 32) || (next_cluster >= END_CLUSTER_16 && FAT_data.fat_type == 16) || (next_cluster >= END_CLUSTER_12 && FAT_data.fat_type == 12)) {
-				printf("Function _directory_remove: End of cluster chain reached. File not found. Aborting...\n");
-				free(cluster_data);
-				return -2;
-			}
+static void _dir_index_free(dir_index_t* index) {
+	for (unsigned int i = 0; i < index->count; i++) free(index->entries[i].long_name);
+	free(index->entries);
+	free(index->buckets);
+	free(index->long_buckets);
+	free(index->holes);
+	memset(index, 0, sizeof(dir_index_t));
+}
 
-			free(cluster_data);
-			return _directory_remove(next_cluster, fileName);
-		}
+static void _dir_index_reset() {
+	for (int i = 0; i < DIR_INDEX_MAX; i++) _dir_index_free(&_dir_indexes[i]);
+}
+
+static void _dir_index_drop(unsigned int cluster) {
+	for (int i = 0; i < DIR_INDEX_MAX; i++) {
+		if (_dir_indexes[i].cluster == cluster) _dir_index_free(&_dir_indexes[i]);
+	}
+}
+
+static dir_index_entry_t* _dir_index_find(dir_index_t* index, const unsigned char* name) {
+	int at = index->buckets[_dir_name_hash(name) & (index->bucket_count - 1)];
+	while (at >= 0) {
+		dir_index_entry_t* item = &index->entries[at];
+		if (memcmp(item->entry.file_name, name, 11) == 0) return item;
+		at = item->next;
 	}
 
-	free(cluster_data);
-	return -1; // Return error
+	return NULL;
 }
 
-int FAT_content_exists(const char* path) {
-	char fileNamePart[256] = { 0 };
-	unsigned short start = 0;
-	unsigned int active_cluster = 0;
+static dir_index_entry_t* _dir_index_find_long(dir_index_t* index, const char* long_name) {
+	unsigned int hash = _lfn_hash(long_name);
+	int at = index->long_buckets[hash & (index->bucket_count - 1)];
+	while (at >= 0) {
+		dir_index_entry_t* item = &index->entries[at];
+		if (item->long_hash == hash && _lfn_equal(item->long_name, long_name)) return item;
+		at = item->long_next;
+	}
 
-	if (FAT_data.fat_type == 32) active_cluster = FAT_data.ext_root_cluster;
-	else {
-		printf("Function FAT_content_exists: FAT16 and FAT12 are not supported!\n");
+	return NULL;
+}
+
+static int _dir_index_rehash(dir_index_t* index, unsigned int bucket_count) {
+	int* buckets = malloc(bucket_count * sizeof(int));
+	int* long_buckets = malloc(bucket_count * sizeof(int));
+	if (!buckets || !long_buckets) {
+		free(buckets);
+		free(long_buckets);
 		return -1;
 	}
 
-	directory_entry_t file_info;
-	for (unsigned int iterator = 0; iterator <= strlen(path); iterator++) {
-		if (path[iterator] == PATH_DELIMITER || !path[iterator]) {
-			memset(fileNamePart, 0, 256);
-			memcpy(fileNamePart, path + start, iterator - start);
+	for (unsigned int i = 0; i < bucket_count; i++) buckets[i] = long_buckets[i] = -1;
+	for (unsigned int i = 0; i < index->count; i++) {
+		dir_index_entry_t* item = &index->entries[i];
+		if (item->entry.file_name[0] == ENTRY_FREE) continue;
 
-			int result = _directory_search(fileNamePart, active_cluster, &file_info, NULL);
-			if (result != 0) return 0;
+		unsigned int bucket = _dir_name_hash(item->entry.file_name) & (bucket_count - 1);
+		item->next = buckets[bucket];
+		buckets[bucket] = (int)i;
 
-			start = iterator + 1;
-			active_cluster = GET_CLUSTER_FROM_ENTRY(file_info, FAT_data.fat_type);
+		if (item->long_name) {
+			bucket = item->long_hash & (bucket_count - 1);
+			item->long_next = long_buckets[bucket];
+			long_buckets[bucket] = (int)i;
 		}
 	}
 
+	free(index->buckets);
+	free(index->long_buckets);
+	index->buckets = buckets;
+	index->long_buckets = long_buckets;
+	index->bucket_count = bucket_count;
+	return 0;
+}
+
+/* Keeps the first entry for a name, as the linear scan would find it. */
+static int _dir_index_insert_long(
+	dir_index_t* index, const directory_entry_t* entry, unsigned int entry_cluster, unsigned int entry_index,
+	const char* long_name, unsigned int lfn_cluster, unsigned int lfn_index, unsigned int lfn_count
+) {
+	if (_dir_index_find(index, entry->file_name)) return 0;
+
+	char* long_copy = NULL;
+	if (long_name && long_name[0]) {
+		long_copy = strdup(long_name);
+		if (!long_copy) return -1;
+	}
+
+	int slot = index->free_head;
+	if (slot >= 0) {
+		index->free_head = index->entries[slot].next;
+	}
+	else {
+		if (index->count == index->capacity) {
+			unsigned int capacity = index->capacity ? index->capacity * 2 : 64;
+			dir_index_entry_t* entries = realloc(index->entries, capacity * sizeof(dir_index_entry_t));
+			if (!entries) {
+				free(long_copy);
+				return -1;
+			}
+
+			index->entries  = entries;
+			index->capacity = capacity;
+		}
+
+		slot = (int)index->count++;
+	}
+
+	dir_index_entry_t* item = &index->entries[slot];
+	memcpy(&item->entry, entry, sizeof(directory_entry_t));
+	item->entry_cluster = entry_cluster;
+	item->entry_index   = entry_index;
+	item->long_name     = long_copy;
+	item->long_hash     = long_copy ? _lfn_hash(long_copy) : 0;
+	item->long_next     = -1;
+	item->lfn_cluster   = lfn_cluster;
+	item->lfn_index     = lfn_index;
+	item->lfn_count     = long_copy ? lfn_count : 0;
+
+	unsigned int bucket = _dir_name_hash(entry->file_name) & (index->bucket_count - 1);
+	item->next = index->buckets[bucket];
+	index->buckets[bucket] = slot;
+
+	if (long_copy) {
+		bucket = item->long_hash & (index->bucket_count - 1);
+		item->long_next = index->long_buckets[bucket];
+		index->long_buckets[bucket] = slot;
+	}
+
+	index->live++;
+	if (index->live > index->bucket_count * 2) return _dir_index_rehash(index, index->bucket_count * 2);
+	return 0;
+}
+
+static inline int _dir_index_insert(dir_index_t* index, const directory_entry_t* entry, unsigned int entry_cluster, unsigned int entry_index) {
+	return _dir_index_insert_long(index, entry, entry_cluster, entry_index, NULL, 0, 0, 0);
+}
+
+static void _dir_index_remove(dir_index_t* index, const unsigned char* name) {
+	int* link = &index->buckets[_dir_name_hash(name) & (index->bucket_count - 1)];
+	while (*link >= 0) {
+		dir_index_entry_t* item = &index->entries[*link];
+		if (memcmp(item->entry.file_name, name, 11) == 0) {
+			int slot = *link;
+			*link = item->next;
+
+			if (item->long_name) {
+				int* long_link = &index->long_buckets[item->long_hash & (index->bucket_count - 1)];
+				while (*long_link >= 0 && *long_link != slot) long_link = &index->entries[*long_link].long_next;
+				if (*long_link == slot) *long_link = item->long_next;
+
+				free(item->long_name);
+				item->long_name = NULL;
+			}
+
+			item->entry.file_name[0] = ENTRY_FREE;
+			item->next = index->free_head;
+			index->free_head = slot;
+			index->live--;
+			return;
+		}
+
+		link = &item->next;
+	}
+}
+
+static int _dir_index_add_hole(dir_index_t* index, unsigned int cluster, unsigned int slot) {
+	if (index->hole_count == index->hole_capacity) {
+		unsigned int capacity = index->hole_capacity ? index->hole_capacity * 2 : 16;
+		dir_slot_t* holes = realloc(index->holes, capacity * sizeof(dir_slot_t));
+		if (!holes) return -1;
+		index->holes = holes;
+		index->hole_capacity = capacity;
+	}
+
+	index->holes[index->hole_count].cluster = cluster;
+	index->holes[index->hole_count].index   = slot;
+	index->hole_count++;
+	return 0;
+}
+
+/* Hands out the next slot of the end region; consecutive calls return consecutive slots of the chain. */
+static int _dir_index_take_end(dir_index_t* index, unsigned int* cluster, unsigned int* slot) {
+	if (!index->end_cluster) return -1;
+
+	*cluster = index->end_cluster;
+	*slot    = index->end_index;
+
+	unsigned int entries_per_cluster = FAT_data.cluster_size / sizeof(directory_entry_t);
+	if (index->end_index + 1 < entries_per_cluster) {
+		index->end_index++;
+		return 0;
+	}
+
+	int next = __read_fat(index->end_cluster);
+	if (next >= 2 && (unsigned int)next < END_CLUSTER_32) {
+		index->end_cluster = (unsigned int)next;
+		index->end_index   = 0;
+	}
+	else {
+		index->end_cluster = 0;
+	}
+
+	return 0;
+}
+
+/* Hands out a free slot: a deleted entry first, then the end of the directory. Returns -1 if the chain is full. */
+static int _dir_index_take_slot(dir_index_t* index, unsigned int* cluster, unsigned int* slot) {
+	if (index->hole_count > 0) {
+		index->hole_count--;
+		*cluster = index->holes[index->hole_count].cluster;
+		*slot    = index->holes[index->hole_count].index;
+		return 0;
+	}
+
+	return _dir_index_take_end(index, cluster, slot);
+}
+
+static dir_index_t* _dir_index_lookup(unsigned int cluster) {
+	for (int i = 0; i < DIR_INDEX_MAX; i++) {
+		if (_dir_indexes[i].cluster == cluster) {
+			_dir_indexes[i].stamp = ++_dir_index_clock;
+			return &_dir_indexes[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Returns the index of a directory, building it with one pass over the chain on first use. */
+static dir_index_t* _dir_index_acquire(unsigned int cluster) {
+	dir_index_t* index = _dir_index_lookup(cluster);
+	if (index) return index;
+
+	index = &_dir_indexes[0];
+	for (int i = 0; i < DIR_INDEX_MAX; i++) {
+		if (!_dir_indexes[i].cluster) {
+			index = &_dir_indexes[i];
+			break;
+		}
+
+		if (_dir_indexes[i].stamp < index->stamp) index = &_dir_indexes[i];
+	}
+
+	_dir_index_free(index);
+	index->free_head = -1;
+	if (_dir_index_rehash(index, 64) != 0) return NULL;
+
+	unsigned int entries_per_cluster = FAT_data.cluster_size / sizeof(directory_entry_t);
+	dir_window_t window;
+	_dir_window_open(&window, cluster);
+
+	lfn_state_t* lfn = malloc(sizeof(lfn_state_t));
+	char* long_name  = malloc(LFN_UTF8_MAX + 1);
+	int loaded = 0, result = (lfn && long_name) ? 0 : -1;
+	if (lfn) _lfn_reset(lfn);
+
+	while (!index->end_cluster && result == 0 && (loaded = _dir_window_fill(&window)) > 0) {
+		directory_entry_t* entries = (directory_entry_t*)window.data;
+		for (unsigned int i = 0; i < (unsigned int)loaded * entries_per_cluster && !index->end_cluster && result == 0; i++) {
+			unsigned int current = window.clusters[i / entries_per_cluster];
+			unsigned int slot    = i % entries_per_cluster;
+			if (entries[i].file_name[0] == ENTRY_END) {
+				index->end_cluster = current;
+				index->end_index   = slot;
+			}
+			else if (entries[i].file_name[0] == ENTRY_FREE) {
+				_lfn_reset(lfn);
+				result = _dir_index_add_hole(index, current, slot);
+			}
+			else if ((entries[i].attributes & FILE_LONG_NAME) == FILE_LONG_NAME) {
+				_lfn_feed(lfn, &entries[i], current, slot);
+			}
+			else {
+				int has_long = _lfn_take(lfn, &entries[i], long_name, LFN_UTF8_MAX + 1);
+				result = _dir_index_insert_long(index, &entries[i], current, slot, has_long ? long_name : NULL, lfn->first_cluster, lfn->first_index, lfn->count);
+				_lfn_reset(lfn);
+			}
+		}
+
+		index->last_cluster = window.clusters[loaded - 1];
+	}
+
+	/* Past the end marker only the FAT is walked, to learn the last cluster. */
+	unsigned int next = window.next;
+	_dir_window_close(&window);
+	free(long_name);
+	free(lfn);
+	while (loaded >= 0 && result == 0 && next >= 2 && !_is_cluster_end(next, FAT_data.fat_type)) {
+		index->last_cluster = next;
+		int following = __read_fat(next);
+		if (following < 0) result = -1;
+		next = (unsigned int)following;
+	}
+
+	if (loaded < 0 || result != 0) {
+		_dir_index_free(index);
+		return NULL;
+	}
+
+	index->cluster = cluster;
+	index->stamp   = ++_dir_index_clock;
+	return index;
+}
+
+/* Refreshes the cached copy of an entry rewritten in place. */
+static void _dir_index_refresh(unsigned int entry_cluster, unsigned int entry_index, const directory_entry_t* entry) {
+	for (int i = 0; i < DIR_INDEX_MAX; i++) {
+		if (!_dir_indexes[i].cluster) continue;
+
+		dir_index_entry_t* item = _dir_index_find(&_dir_indexes[i], entry->file_name);
+		if (item && item->entry_cluster == entry_cluster && item->entry_index == entry_index) {
+			memcpy(&item->entry, entry, sizeof(directory_entry_t));
+		}
+	}
+}
+
+/* Finds an entry by its 11-byte 8.3 name, through the directory index when one can be built. */
+static int _directory_locate(const unsigned char* fatname, const unsigned int cluster, directory_entry_t* file, unsigned int* entryOffset, unsigned int* entryCluster) {
+	dir_index_t* index = _dir_index_acquire(cluster);
+	if (index) {
+		dir_index_entry_t* item = _dir_index_find(index, fatname);
+		if (!item) return -2;
+
+		if (file != NULL) memcpy(file, &item->entry, sizeof(directory_entry_t));
+		if (entryOffset != NULL) *entryOffset = item->entry_index;
+		if (entryCluster != NULL) *entryCluster = item->entry_cluster;
+		return 0;
+	}
+
+	unsigned int entries_per_cluster = FAT_data.cluster_size / sizeof(directory_entry_t);
+	dir_window_t window;
+	_dir_window_open(&window, cluster);
+
+	int loaded = 0, result = -2;
+	while ((loaded = _dir_window_fill(&window)) > 0) {
+		DSC_result_t scan;
+		DSC_scan(window.data, loaded * entries_per_cluster, fatname, &scan);
+		if (scan.match >= 0) {
+			if (file != NULL) memcpy(file, window.data + scan.match * sizeof(directory_entry_t), sizeof(directory_entry_t));
+			if (entryOffset != NULL) *entryOffset = (unsigned int)scan.match % entries_per_cluster;
+			if (entryCluster != NULL) *entryCluster = window.clusters[scan.match / entries_per_cluster];
+			result = 0;
+			break;
+		}
+
+		if (scan.end >= 0) break;
+	}
+
+	if (loaded < 0) {
+		printf("Function _directory_locate: reading of the directory chain failed. Aborting...\n");
+		result = -1;
+	}
+
+	_dir_window_close(&window);
+	return result;
+}
+
+/* Finds an entry by its long name, ignoring ASCII case. */
+static int _directory_locate_long(const char* long_name, const unsigned int cluster, directory_entry_t* file, unsigned int* entryOffset, unsigned int* entryCluster) {
+	dir_index_t* index = _dir_index_acquire(cluster);
+	if (index) {
+		dir_index_entry_t* item = _dir_index_find_long(index, long_name);
+		if (!item) return -2;
+
+		if (file != NULL) memcpy(file, &item->entry, sizeof(directory_entry_t));
+		if (entryOffset != NULL) *entryOffset = item->entry_index;
+		if (entryCluster != NULL) *entryCluster = item->entry_cluster;
+		return 0;
+	}
+
+	DirIter_t it;
+	if (FAT_directory_open_cluster(cluster, &it) != 0) return -1;
+
+	DirEntry_t* item = malloc(sizeof(DirEntry_t));
+	int result = item ? -2 : -1;
+	int next = 0;
+	while (item && (next = FAT_directory_next(&it, item)) == 1) {
+		if (!item->long_name[0] || !_lfn_equal(item->long_name, long_name)) continue;
+
+		if (file != NULL) memcpy(file, &item->entry, sizeof(directory_entry_t));
+		if (entryOffset != NULL) *entryOffset = item->entry_index;
+		if (entryCluster != NULL) *entryCluster = item->entry_cluster;
+		result = 0;
+		break;
+	}
+
+	if (next < 0) result = -1;
+	free(item);
+	FAT_directory_close(&it);
+	return result;
+}
+
+static int _directory_search(const char* filepart, const unsigned int cluster, directory_entry_t* file, unsigned int* entryOffset, unsigned int* entryCluster) {
+	if (_lfn_needed(filepart)) {
+		if (!_lfn_valid(filepart)) return -2;
+		return _directory_locate_long(filepart, cluster, file, entryOffset, entryCluster);
+	}
+
+	char searchName[13] = { 0 };
+	strcpy(searchName, filepart);
+	if (_name_check(searchName)) {
+		_name2fatname(searchName);
+	}
+
+	return _directory_locate((unsigned char*)searchName, cluster, file, entryOffset, entryCluster);
+}
+
+/*
+Single pass used when a directory has no index: fails with -3 if the name
+exists, otherwise reports the first reusable slot (slot_cluster 0 if none)
+and the last cluster of the chain.
+*/
+static int _directory_find_slot(const unsigned int cluster, const unsigned char* name, unsigned int* slot_cluster, unsigned int* slot_index, unsigned int* last_cluster) {
+	unsigned int entries_per_cluster = FAT_data.cluster_size / sizeof(directory_entry_t);
+	*slot_cluster = 0;
+
+	dir_window_t window;
+	_dir_window_open(&window, cluster);
+
+	int loaded = 0, result = 0;
+	while ((loaded = _dir_window_fill(&window)) > 0) {
+		*last_cluster = window.clusters[loaded - 1];
+
+		DSC_result_t scan;
+		DSC_scan(window.data, loaded * entries_per_cluster, name, &scan);
+		if (scan.match >= 0) {
+			result = -3;
+			break;
+		}
+
+		int slot = scan.free >= 0 ? scan.free : scan.end;
+		if (slot >= 0 && !*slot_cluster) {
+			*slot_cluster = window.clusters[slot / entries_per_cluster];
+			*slot_index   = (unsigned int)slot % entries_per_cluster;
+		}
+
+		if (scan.end >= 0) break;
+	}
+
+	if (loaded < 0) {
+		printf("Function _directory_find_slot: reading of the directory chain failed. Aborting...\n");
+		result = -1;
+	}
+
+	_dir_window_close(&window);
+	return result;
+}
+
+/* Appends a zeroed cluster to a directory chain. */
+static unsigned int _directory_extend(unsigned int last_cluster) {
+	unsigned int new_cluster = _cluster_allocate();
+	if (new_cluster == 0) return 0;
+
+	unsigned char* zero = calloc(1, FAT_data.cluster_size);
+	int zeroed = zero && _cluster_write(zero, new_cluster) == 0;
+	free(zero);
+	if (!zeroed || __write_fat(last_cluster, new_cluster) != 0) {
+		_cluster_deallocate(new_cluster);
+		return 0;
+	}
+
+	return new_cluster;
+}
+
+/* Stamps creation times and gives the entry a first cluster unless it already has one. */
+static int _directory_entry_prepare(directory_entry_t* entry) {
+	entry->creation_date 		  = DTM_current_date();
+	entry->creation_time 		  = DTM_current_time();
+	entry->creation_time_tenths   = DTM_current_time();
+	entry->last_accessed 		  = entry->creation_date;
+	entry->last_modification_date = entry->creation_date;
+	entry->last_modification_time = entry->creation_time;
+
+	if (GET_CLUSTER_FROM_PENTRY(entry, FAT_data.fat_type) >= 2) return 0;
+
+	unsigned int new_cluster = _cluster_allocate();
+	if (new_cluster == 0 || _is_cluster_bad(new_cluster, FAT_data.fat_type) == 1) return -1;
+
+	entry->low_bits  = GET_ENTRY_LOW_BITS(new_cluster, FAT_data.fat_type);
+	entry->high_bits = GET_ENTRY_HIGH_BITS(new_cluster, FAT_data.fat_type);
+	return 0;
+}
+
+/*
+Builds the n-th short alias of a long name (n from 1): BASIS~N.EXT, with
+four hex digits of the name hash in the basis once the first four are taken.
+*/
+static void _lfn_alias(const char* long_name, unsigned int n, unsigned char* alias) {
+	memset(alias, ' ', 11);
+
+	const char* dot = strrchr(long_name, '.');
+	if (dot == long_name) dot = NULL;
+
+	char basis[8], ext[3];
+	unsigned int basis_len = 0, ext_len = 0;
+	for (const unsigned char* p = (const unsigned char*)long_name; *p; p++) {
+		int in_ext = dot && (const char*)p > dot;
+		if (*p == ' ' || *p == '.' || (*p & 0xC0) == 0x80) continue;
+
+		char c = (*p >= 0x80 || strchr("+,;=[]", *p)) ? '_' : (char)toupper(*p);
+		if (in_ext && ext_len < sizeof(ext)) ext[ext_len++] = c;
+		else if (!in_ext && basis_len < sizeof(basis)) basis[basis_len++] = c;
+	}
+
+	if (!basis_len) basis[basis_len++] = '_';
+
+	char tail[12];
+	unsigned int tail_len = (unsigned int)sprintf(tail, "~%u", n <= 4 ? n : n - 4);
+	unsigned int keep = MIN(basis_len, n <= 4 ? 8 - tail_len : 2);
+	memcpy(alias, basis, keep);
+
+	if (n > 4) {
+		char hash[5];
+		sprintf(hash, "%04X", _lfn_hash(long_name) & 0xFFFF);
+		memcpy(alias + keep, hash, 4);
+		keep += 4;
+	}
+
+	if (keep + tail_len > 8) keep = 8 - tail_len;
+	memcpy(alias + keep, tail, tail_len);
+	memcpy(alias + 8, ext, ext_len);
+}
+
+/* Takes count consecutive slots from the end of a directory, growing its chain when it runs out. */
+static int _directory_take_run(dir_index_t* index, unsigned int count, dir_slot_t* slots) {
+	for (unsigned int i = 0; i < count; i++) {
+		if (!index->end_cluster) {
+			unsigned int new_cluster = _directory_extend(index->last_cluster);
+			if (!new_cluster) return -1;
+
+			index->last_cluster = new_cluster;
+			index->end_cluster  = new_cluster;
+			index->end_index    = 0;
+		}
+
+		if (_dir_index_take_end(index, &slots[i].cluster, &slots[i].index) != 0) return -1;
+	}
+
+	return 0;
+}
+
+/*
+Inserts an entry carrying a long name: picks a free alias, then writes the
+LFN slots and the entry itself as one sequence at the end of the directory.
+Needs the directory index, which is what keeps alias picking cheap.
+*/
+static int _directory_add_long(const unsigned int cluster, directory_entry_t* file_to_add, const char* long_name) {
+	dir_index_t* index = _dir_index_acquire(cluster);
+	if (!index) {
+		printf("Function _directory_add_long: directory index is not available. Aborting...\n");
+		return -1;
+	}
+
+	if (_dir_index_find_long(index, long_name)) return -3;
+
+	unsigned short units[LFN_NAME_MAX];
+	unsigned int length = _utf8_to_utf16(long_name, units, LFN_NAME_MAX);
+	if (!length) {
+		printf("Function _directory_add_long: Invalid long file name!\n");
+		return -1;
+	}
+
+	unsigned int n = 1;
+	for (; n < 1000000; n++) {
+		_lfn_alias(long_name, n, file_to_add->file_name);
+		if (!_dir_index_find(index, file_to_add->file_name)) break;
+	}
+
+	if (n == 1000000) {
+		printf("Function _directory_add_long: no free short alias left. Aborting...\n");
+		return -1;
+	}
+
+	unsigned int lfn_count = (length + LFN_CHARS - 1) / LFN_CHARS;
+	dir_slot_t slots[LFN_MAX_SLOTS + 1];
+	directory_entry_t entries[LFN_MAX_SLOTS + 1];
+	if (_directory_take_run(index, lfn_count + 1, slots) != 0) {
+		printf("Function _directory_add_long: extension of the cluster chain with new cluster failed. Aborting...\n");
+		_dir_index_drop(cluster);
+		return -1;
+	}
+
+	if (_directory_entry_prepare(file_to_add) != 0) {
+		printf("Function _directory_add_long: allocation of new cluster failed. Aborting...\n");
+		_dir_index_drop(cluster);
+		return -1;
+	}
+
+	unsigned char checksum = _lfn_checksum(file_to_add->file_name);
+	for (unsigned int k = 0; k < lfn_count; k++) {
+		_lfn_fill(&entries[k], lfn_count - k, k == 0, checksum, units, length);
+	}
+
+	memcpy(&entries[lfn_count], file_to_add, sizeof(directory_entry_t));
+
+	/* The sequence may straddle clusters; each cluster gets one write. */
+	for (unsigned int first = 0, k = 1; k <= lfn_count + 1; k++) {
+		if (k <= lfn_count && slots[k].cluster == slots[first].cluster) continue;
+		if (_directory_slots_write(slots[first].cluster, slots[first].index, &entries[first], k - first) != 0) {
+			printf("Function _directory_add_long: Writing new directory entries failed. Aborting...\n");
+			_dir_index_drop(cluster);
+			return -1;
+		}
+
+		first = k;
+	}
+
+	if (_dir_index_insert_long(index, file_to_add, slots[lfn_count].cluster, slots[lfn_count].index, long_name, slots[0].cluster, slots[0].index, lfn_count) != 0) {
+		_dir_index_drop(cluster);
+	}
+
+	return 0;
+}
+
+/*
+Inserts an entry into a directory, failing with -3 if the name is taken.
+With an index the slot comes straight from its free-slot hints; without
+one a single scan checks the name and finds the slot.
+*/
+static int _directory_add(const unsigned int cluster, directory_entry_t* file_to_add, const char* long_name) {
+	if (long_name) return _directory_add_long(cluster, file_to_add, long_name);
+
+	unsigned int slot_cluster = 0, slot_index = 0, last_cluster = cluster;
+
+	dir_index_t* index = _dir_index_acquire(cluster);
+	if (index) {
+		if (_dir_index_find(index, file_to_add->file_name)) return -3;
+		if (_dir_index_take_slot(index, &slot_cluster, &slot_index) != 0) slot_cluster = 0;
+		last_cluster = index->last_cluster;
+	}
+	else {
+		int result = _directory_find_slot(cluster, file_to_add->file_name, &slot_cluster, &slot_index, &last_cluster);
+		if (result != 0) return result;
+	}
+
+	if (!slot_cluster) {
+		slot_cluster = _directory_extend(last_cluster);
+		slot_index   = 0;
+		if (!slot_cluster) {
+			printf("Function _directory_add: extension of the cluster chain with new cluster failed. Aborting...\n");
+			return -1;
+		}
+
+		if (index) {
+			index->last_cluster = slot_cluster;
+			index->end_cluster  = slot_cluster;
+			index->end_index    = 1;
+		}
+	}
+
+	if (_directory_entry_prepare(file_to_add) != 0) {
+		printf("Function _directory_add: allocation of new cluster failed. Aborting...\n");
+		if (index) _dir_index_drop(cluster);
+		return -1;
+	}
+
+	if (_directory_slot_write(slot_cluster, slot_index, file_to_add) != 0) {
+		printf("Function _directory_add: Writing new directory entry failed. Aborting...\n");
+		if (index) _dir_index_drop(cluster);
+		return -1;
+	}
+
+	if (index && _dir_index_insert(index, file_to_add, slot_cluster, slot_index) != 0) _dir_index_drop(cluster);
+	return 0;
+}
+
+/* Marks the LFN slots of an entry deleted; they may run across a cluster boundary. */
+static int _directory_lfn_release(dir_index_t* index, unsigned int cluster, unsigned int slot, unsigned int count) {
+	unsigned int entries_per_cluster = FAT_data.cluster_size / sizeof(directory_entry_t);
+	const unsigned char mark = ENTRY_FREE;
+	for (unsigned int i = 0; i < count; i++) {
+		if (_cluster_writeoff(&mark, cluster, slot * sizeof(directory_entry_t), 1) != 0) return -1;
+		if (_dir_index_add_hole(index, cluster, slot) != 0) return -1;
+
+		if (++slot == entries_per_cluster && i + 1 < count) {
+			int next = __read_fat(cluster);
+			if (next < 2 || _is_cluster_end((unsigned int)next, FAT_data.fat_type)) return -1;
+			cluster = (unsigned int)next;
+			slot    = 0;
+		}
+	}
+
+	return 0;
+}
+
+/* Drops the long name of an entry from disk and from the index. */
+static int _directory_lfn_drop(dir_index_t* index, const unsigned char* name) {
+	dir_index_entry_t* item = index ? _dir_index_find(index, name) : NULL;
+	if (!item || !item->lfn_count) return 0;
+	return _directory_lfn_release(index, item->lfn_cluster, item->lfn_index, item->lfn_count);
+}
+
+static int _directory_edit(const unsigned int cluster, directory_entry_t* old_meta, const char* new_name) {
+	if (_name_check((char*)old_meta->file_name) != 0) {
+		printf("Function _directory_edit: Invalid file name!");
+		return -1;
+	}
+
+	unsigned int entry_cluster = 0, entry_index = 0;
+	int result = _directory_locate(old_meta->file_name, cluster, NULL, &entry_index, &entry_cluster);
+	if (result == -2) {
+		printf("Function _directory_edit: End of cluster chain reached. File not found. Aborting...\n");
+		return -2;
+	}
+	else if (result != 0) {
+		return -1;
+	}
+
+	/* The index is loaded before the alias changes, so it still ties the old long name to its slots. */
+	dir_index_t* index = _dir_index_acquire(cluster);
+	if (!index) {
+		printf("Function _directory_edit: Indexing the directory failed. Aborting...\n");
+		return -1;
+	}
+
+	unsigned char old_name[11];
+	memcpy(old_name, old_meta->file_name, 11);
+
+	old_meta->last_accessed = DTM_current_date();
+	old_meta->last_modification_date = DTM_current_date();
+	old_meta->last_modification_time = DTM_current_time();
+
+	memset(old_meta->file_name, 0, 11);
+	strncpy((char*)old_meta->file_name, new_name, 11);
+	if (_directory_slot_write(entry_cluster, entry_index, old_meta) != 0) {
+		printf("Function _directory_edit: Writing updated directory entry failed. Aborting...\n");
+		return -1;
+	}
+
+	/* The old long name no longer matches the alias checksum, so it goes. */
+	if (_directory_lfn_drop(index, old_name) != 0) _dir_index_drop(cluster);
+	else {
+		_dir_index_remove(index, old_name);
+		if (_dir_index_insert(index, old_meta, entry_cluster, entry_index) != 0) _dir_index_drop(cluster);
+	}
+
+	return 0;
+}
+
+static int _directory_remove(const unsigned int cluster, const char* fileName) {
+	if (_name_check(fileName) != 0) {
+		printf("Function _directory_remove: Invalid file name!");
+		return -1;
+	}
+
+	directory_entry_t entry;
+	unsigned int entry_cluster = 0, entry_index = 0;
+	int result = _directory_locate((const unsigned char*)fileName, cluster, &entry, &entry_index, &entry_cluster);
+	if (result == -2) {
+		printf("Function _directory_remove: End of cluster chain reached. File not found. Aborting...\n");
+		return -2;
+	}
+	else if (result != 0) {
+		return -1;
+	}
+
+	/* As in _directory_edit, the index has to see the entry before it is freed to find its long name. */
+	dir_index_t* index = _dir_index_acquire(cluster);
+	if (!index) {
+		printf("Function _directory_remove: Indexing the directory failed. Aborting...\n");
+		return -1;
+	}
+
+	entry.file_name[0] = ENTRY_FREE;
+	if (_directory_slot_write(entry_cluster, entry_index, &entry) != 0) {
+		printf("Function _directory_remove: Writing updated directory entry failed. Aborting...\n");
+		return -1;
+	}
+
+	if (_directory_lfn_drop(index, (const unsigned char*)fileName) != 0) _dir_index_drop(cluster);
+	else {
+		_dir_index_remove(index, (const unsigned char*)fileName);
+		if (_dir_index_add_hole(index, entry_cluster, entry_index) != 0) _dir_index_drop(cluster);
+	}
+
+	return 0;
+}
+
+static int _directory_entry_write(unsigned int cluster, unsigned int index, const directory_entry_t* entry) {
+	int result = _directory_slot_write(cluster, index, entry);
+	if (result == 0) {
+		_dir_index_refresh(cluster, index, entry);
+		_dcache_refresh(cluster, index, entry);
+	}
+
+	return result;
+}
+
+static void _fatname2path(const unsigned char* fatname, char* output) {
+	_fatname2name((char*)fatname, output);
+	for (int i = 11; i >= 0 && (output[i] == ' ' || output[i] == '.'); i--) output[i] = 0;
+}
+
+static dentry_t* _dcache_paths[DCACHE_BUCKETS];
+static dentry_t* _dcache_locations[DCACHE_BUCKETS];
+static unsigned int _dcache_count = 0;
+
+static inline unsigned int _dcache_path_hash(const char* path) {
+	unsigned int hash = 2166136261u;
+	for (; *path; path++) {
+		hash ^= (unsigned char)*path;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static inline unsigned int _dcache_location_hash(unsigned int entry_cluster, unsigned int entry_index) {
+	return (entry_cluster * 2654435761u) ^ entry_index;
+}
+
+static void _dcache_unlink(dentry_t* dentry) {
+	dentry_t** link = &_dcache_paths[dentry->hash & (DCACHE_BUCKETS - 1)];
+	while (*link && *link != dentry) link = &(*link)->next;
+	if (*link) *link = dentry->next;
+
+	if (!dentry->negative) {
+		link = &_dcache_locations[_dcache_location_hash(dentry->entry_cluster, dentry->entry_index) & (DCACHE_BUCKETS - 1)];
+		while (*link && *link != dentry) link = &(*link)->loc_next;
+		if (*link) *link = dentry->loc_next;
+	}
+
+	free(dentry->path);
+	free(dentry);
+	_dcache_count--;
+}
+
+static void _dcache_reset() {
+	for (int i = 0; i < DCACHE_BUCKETS; i++) {
+		dentry_t* dentry = _dcache_paths[i];
+		while (dentry) {
+			dentry_t* next = dentry->next;
+			free(dentry->path);
+			free(dentry);
+			dentry = next;
+		}
+
+		_dcache_paths[i] = NULL;
+		_dcache_locations[i] = NULL;
+	}
+
+	_dcache_count = 0;
+}
+
+static dentry_t* _dcache_find(const char* path, unsigned int hash) {
+	for (dentry_t* dentry = _dcache_paths[hash & (DCACHE_BUCKETS - 1)]; dentry; dentry = dentry->next) {
+		if (dentry->hash == hash && strcmp(dentry->path, path) == 0) return dentry;
+	}
+
+	return NULL;
+}
+
+static void _dcache_insert(const char* path, const dentry_t* value) {
+	if (_dcache_count >= DCACHE_MAX) _dcache_reset();
+
+	dentry_t* dentry = malloc(sizeof(dentry_t));
+	if (!dentry) return;
+
+	memcpy(dentry, value, sizeof(dentry_t));
+	dentry->path = strdup(path);
+	if (!dentry->path) {
+		free(dentry);
+		return;
+	}
+
+	dentry->hash = _dcache_path_hash(path);
+	unsigned int bucket = dentry->hash & (DCACHE_BUCKETS - 1);
+	dentry->next = _dcache_paths[bucket];
+	_dcache_paths[bucket] = dentry;
+
+	dentry->loc_next = NULL;
+	if (!dentry->negative) {
+		bucket = _dcache_location_hash(dentry->entry_cluster, dentry->entry_index) & (DCACHE_BUCKETS - 1);
+		dentry->loc_next = _dcache_locations[bucket];
+		_dcache_locations[bucket] = dentry;
+	}
+
+	_dcache_count++;
+}
+
+/* Refreshes cached copies of an entry rewritten in place (under any path alias). */
+static void _dcache_refresh(unsigned int entry_cluster, unsigned int entry_index, const directory_entry_t* entry) {
+	unsigned int bucket = _dcache_location_hash(entry_cluster, entry_index) & (DCACHE_BUCKETS - 1);
+	for (dentry_t* dentry = _dcache_locations[bucket]; dentry; dentry = dentry->loc_next) {
+		if (dentry->entry_cluster == entry_cluster && dentry->entry_index == entry_index) {
+			memcpy(&dentry->entry, entry, sizeof(directory_entry_t));
+		}
+	}
+}
+
+/* Drops every path that points at an entry slot; used when the entry is renamed or removed. */
+static void _dcache_forget_location(unsigned int entry_cluster, unsigned int entry_index) {
+	unsigned int bucket = _dcache_location_hash(entry_cluster, entry_index) & (DCACHE_BUCKETS - 1);
+	dentry_t* dentry = _dcache_locations[bucket];
+	while (dentry) {
+		dentry_t* next = dentry->loc_next;
+		if (dentry->entry_cluster == entry_cluster && dentry->entry_index == entry_index) _dcache_unlink(dentry);
+		dentry = next;
+	}
+}
+
+static void _dcache_forget_path(const char* path) {
+	dentry_t* dentry = _dcache_find(path, _dcache_path_hash(path));
+	if (dentry) _dcache_unlink(dentry);
+}
+
+static void _dcache_forget_negative() {
+	for (int i = 0; i < DCACHE_BUCKETS; i++) {
+		dentry_t* dentry = _dcache_paths[i];
+		while (dentry) {
+			dentry_t* next = dentry->next;
+			if (dentry->negative) _dcache_unlink(dentry);
+			dentry = next;
+		}
+	}
+}
+
+/* Collapses repeated delimiters and upper-cases, so "root//bench/" and "ROOT/BENCH" share a key. */
+static int _path_normalize(const char* path, char* out, size_t outsz) {
+	size_t len = 0;
+	for (const char* p = path ? path : ""; *p; p++) {
+		if (*p == PATH_DELIMITER && (len == 0 || out[len - 1] == PATH_DELIMITER)) continue;
+		if (len + 1 >= outsz) return -1;
+		out[len++] = (char)toupper((unsigned char)*p);
+	}
+
+	if (len > 0 && out[len - 1] == PATH_DELIMITER) len--;
+	out[len] = 0;
+	return 0;
+}
+
+/* Drops the cached entry, usually a miss, for name inside the directory at path. */
+static void _dcache_forget_child(const char* path, const char* name) {
+	char key[DCACHE_PATH_MAX];
+	if (_path_normalize(path, key, sizeof(key)) != 0) return;
+
+	size_t base = strlen(key);
+	if (base + strlen(name) + 2 > sizeof(key)) return;
+	if (base) key[base++] = PATH_DELIMITER;
+	for (const char* p = name; *p; p++) key[base++] = (char)toupper((unsigned char)*p);
+	key[base] = 0;
+	_dcache_forget_path(key);
+}
+
+/*
+Resolves a path to its directory entry and location. Every prefix is cached,
+misses included, so a warm lookup is one hash probe and does no I/O.
+The empty path resolves to the root directory (entry_cluster 0).
+Returns 0, -2 if a component does not exist, -1 on errors.
+*/
+static int _path_resolve(const char* path, dentry_t* out) {
+	char key[DCACHE_PATH_MAX];
+	if (_path_normalize(path, key, sizeof(key)) != 0) return -1;
+
+	dentry_t current;
+	memset(&current, 0, sizeof(dentry_t));
+	current.entry.attributes = FILE_DIRECTORY;
+	current.entry.low_bits   = GET_ENTRY_LOW_BITS(FAT_data.ext_root_cluster, FAT_data.fat_type);
+	current.entry.high_bits  = GET_ENTRY_HIGH_BITS(FAT_data.ext_root_cluster, FAT_data.fat_type);
+	current.parent_cluster   = FAT_data.ext_root_cluster;
+
+	dentry_t* hit = key[0] ? _dcache_find(key, _dcache_path_hash(key)) : NULL;
+	if (hit) {
+		if (hit->negative) return -2;
+		memcpy(&current, hit, sizeof(dentry_t));
+	}
+	else {
+		size_t start = 0;
+		size_t len = strlen(key);
+		for (size_t i = 0; i < len + 1 && len > 0; i++) {
+			if (key[i] != PATH_DELIMITER && key[i]) continue;
+
+			char saved = key[i];
+			key[i] = 0;
+
+			hit = _dcache_find(key, _dcache_path_hash(key));
+			if (hit && hit->negative) return -2;
+			if (hit) {
+				memcpy(&current, hit, sizeof(dentry_t));
+			}
+			else {
+				if ((current.entry.attributes & FILE_DIRECTORY) != FILE_DIRECTORY) return -2;
+
+				dentry_t found;
+				memset(&found, 0, sizeof(dentry_t));
+				found.parent_cluster = GET_CLUSTER_FROM_ENTRY(current.entry, FAT_data.fat_type);
+
+				int result = -2;
+				if (i - start <= LFN_UTF8_MAX) {
+					result = _directory_search(key + start, found.parent_cluster, &found.entry, &found.entry_index, &found.entry_cluster);
+				}
+
+				if (result == -1) return -1;
+				found.negative = (result == -2);
+				_dcache_insert(key, &found);
+				if (found.negative) return -2;
+
+				memcpy(&current, &found, sizeof(dentry_t));
+			}
+
+			key[i] = saved;
+			start = i + 1;
+		}
+	}
+
+	memcpy(out, &current, sizeof(dentry_t));
+	out->path = NULL;
+	out->next = NULL;
+	out->loc_next = NULL;
+	return 0;
+}
+
+int FAT_content_exists(const char* path) {
+	if (FAT_data.fat_type != 32) {
+		printf("Function FAT_content_exists: FAT16 and FAT12 are not supported!\n");
+		return -1;
+	}
+
+	dentry_t dentry;
+	return (_path_resolve(path, &dentry) == 0) ? 1 : 0;
+}
+
+int FAT_open_content(const char* path) {
+	if (FAT_data.fat_type != 32) {
+		printf("Function FAT_open_content: FAT16 and FAT12 are not supported!\n");
+		return -2;
+	}
+
+	dentry_t dentry;
+	int result = _path_resolve(path, &dentry);
+	if (result == -2) return -3;
+	if (result != 0) return -4;
+
+	Content* fat_content = FAT_create_content();
+	if (!fat_content) return -1;
+
+	directory_entry_t content_meta = dentry.entry;
+	fat_content->parent_cluster = dentry.parent_cluster;
+	fat_content->entry_cluster  = dentry.entry_cluster;
+	fat_content->entry_index    = dentry.entry_index;
+
+	memcpy(&fat_content->meta, &content_meta, sizeof(directory_entry_t));
+	if ((content_meta.attributes & FILE_DIRECTORY) != FILE_DIRECTORY) {
+		fat_content->file = _create_file();
+		if (!fat_content->file) {
+			FAT_unload_content_system(fat_content);
+			return -5;
+		}
+
+		fat_content->content_type = CONTENT_TYPE_FILE;
+		unsigned int* content = NULL;
+		int content_size = 0;
+		
+		int cluster = GET_CLUSTER_FROM_ENTRY(content_meta, FAT_data.fat_type);
+		while (cluster < END_CLUSTER_32) {
+			unsigned int* new_content = (unsigned int*)realloc(content, (content_size + 1) * sizeof(unsigned int));
+			if (new_content == NULL) {
+				free(content);
+				FAT_unload_content_system(fat_content);
+				return -6;
+			}
+
+			new_content[content_size] = cluster;
+			content = new_content;
+			content_size++;
+
+			cluster = __read_fat(cluster);
+			if (cluster == BAD_CLUSTER_32) {
+				printf("Function FAT_open_content: the cluster chain is corrupted with a bad cluster. Aborting...\n");
+				free(content);
+				FAT_unload_content_system(fat_content);
+				return -7;
+			}
+			else if (cluster == -1) {
+				printf("Function FAT_open_content: an error occurred in __read_fat. Aborting...\n");
+				free(content);
+				FAT_unload_content_system(fat_content);
+				return -8;
+			}
+		}
+		
+		fat_content->file->data = (unsigned int*)malloc(content_size * sizeof(unsigned int));
+		if (!fat_content->file->data) {
+			free(content);
+			free(fat_content->file);
+			FAT_unload_content_system(fat_content);
+			return -9;
+		}
+
+		memcpy(fat_content->file->data, content, content_size * sizeof(unsigned int));
+		fat_content->file->data_size = content_size;
+		free(content);
+
+		char full[13] = {0};
+		_fatname2name((char*)fat_content->meta.file_name, full);   // например "TEST_1.TXT" или "ASD"
+
+		fat_content->file->name[0] = 0;
+		fat_content->file->extension[0] = 0;
+
+		char* dot = strchr(full, '.');
+		if (dot) {
+		    *dot = 0;
+		
+		    strncpy(fat_content->file->name, full, sizeof(fat_content->file->name) - 1);
+		    fat_content->file->name[sizeof(fat_content->file->name) - 1] = 0;
+		
+		    strncpy(fat_content->file->extension, dot + 1, sizeof(fat_content->file->extension) - 1);
+		    fat_content->file->extension[sizeof(fat_content->file->extension) - 1] = 0;
+		} 
+		else {
+		    strncpy(fat_content->file->name, full, sizeof(fat_content->file->name) - 1);
+		    fat_content->file->name[sizeof(fat_content->file->name) - 1] = 0;
+		    fat_content->file->extension[0] = 0;
+		}
+	}
+	else {
+		fat_content->directory = _create_directory();
+		if (!fat_content->directory) {
+			FAT_unload_content_system(fat_content);
+			return -10;
+		}
+
+		fat_content->content_type = CONTENT_TYPE_DIRECTORY;
+		char dname[13] = {0};
+		_fatname2name((char*)content_meta.file_name, dname);
+		char* dot = strchr(dname, '.');
+		if (dot) *dot = 0;
+			
+		strncpy(fat_content->directory->name, dname, sizeof(fat_content->directory->name) - 1);
+		fat_content->directory->name[sizeof(fat_content->directory->name) - 1] = 0;
+	}
+
+	int ci = _add_content2table(fat_content);
+	if (ci < 0) {
+		printf("Function FAT_open_content: an error occurred in _add_content2table. Aborting...\n");
+		if (fat_content->file) free(fat_content->file);
+		else if (fat_content->directory) free(fat_content->directory);
+		FAT_unload_content_system(fat_content);
+		return -11;
+	}
+
+	return ci;
+}
+
+Content* FAT_get_content_from_table(int ci) {
+	if (ci < 0 || ci >= CONTENT_TABLE_SIZE) return NULL;
+	return _content_table[ci];
+}
+
+/* Gives back clusters held past the end of file, keeping the first one the entry points at. */
+static int _content_trim(int ci) {
+	Content* c = FAT_get_content_from_table(ci);
+	if (!c || c->content_type != CONTENT_TYPE_FILE || !c->file || !c->file->data || c->file->data_size <= 0) return 0;
+
+	unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+	unsigned int keep = (unsigned int)(((uint64_t)c->meta.file_size + cluster_bytes - 1) / cluster_bytes);
+	if (keep == 0) keep = 1;
+	if ((unsigned int)c->file->data_size <= keep) return 0;
+
+	_fat_batch_begin();
+	_chain_free(c->file->data[keep]);
+	int result = _set_cluster_end(c->file->data[keep - 1], FAT_data.fat_type);
+	if (_fat_batch_end() != 0) result = -1;
+	if (result != 0) return -1;
+
+	c->file->data_size = (int)keep;
+	return 0;
+}
+
+/* Writes back and releases a handle. The handle is freed even when writing back fails; that error is returned. */
+int FAT_close_content(int ci) {
+	int result = 0;
+	if (FAT_flush(ci) < -1) {
+		printf("Function FAT_close_content: writing back file state failed.\n");
+		result = -2;
+	}
+	else if (_content_trim(ci) != 0) {
+		printf("Function FAT_close_content: releasing clusters past the end of file failed.\n");
+		result = -3;
+	}
+	else if (DSK_sync_close() != 1) {
+		printf("Function FAT_close_content: syncing the image failed.\n");
+		result = -4;
+	}
+
+	int removed = _remove_content_from_table(ci);
+	return (result != 0) ? result : removed;
+}
+
+int FAT_read_content2buffer(int ci, unsigned char* buffer, unsigned int offset, unsigned int size) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file) return -1;
+    _async_quiesce(ci);
+
+    unsigned int file_size = _content_size(c);
+    if (offset >= file_size) return 0;
+
+    unsigned int to_read = size;
+    if (to_read > file_size - offset) to_read = file_size - offset;
+
+    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+
+    /* Buffered bytes, and any gap they leave past the allocated chain, are only readable once emitted. */
+    if (c->wbuf_size > 0 && offset + to_read > MIN(c->wbuf_offset, (unsigned int)c->file->data_size * cluster_bytes)) {
+        if (_content_flush_wbuf(ci) != 0) return -2;
+    }
+
+    unsigned int cluster_seek   = offset / cluster_bytes;
+    unsigned int in_cluster_off = offset % cluster_bytes;
+
+    /* Each run of physically consecutive clusters is one read into the caller's buffer. */
+    unsigned int pos = 0;
+    unsigned int data_size = (unsigned int)c->file->data_size;
+    while (pos < to_read && cluster_seek < data_size) {
+        unsigned int run = 1;
+        unsigned int span = cluster_bytes - in_cluster_off;
+        while (span < to_read - pos && cluster_seek + run < data_size && c->file->data[cluster_seek + run] == c->file->data[cluster_seek] + run) {
+            span += cluster_bytes;
+            run++;
+        }
+
+        unsigned int chunk = MIN(to_read - pos, span);
+        if (_cluster_run_read(c->file->data[cluster_seek], in_cluster_off, buffer + pos, chunk) != 0) {
+            return (int)pos;
+        }
+
+        pos += chunk;
+        cluster_seek += run;
+        in_cluster_off = 0;
+    }
+
+    if (pos < to_read && c->delalloc_size > 0) {
+        unsigned int at = offset + pos - (unsigned int)c->file->data_size * cluster_bytes;
+        if (at < c->delalloc_size) {
+            unsigned int chunk = MIN(to_read - pos, c->delalloc_size - at);
+            memcpy(buffer + pos, c->delalloc + at, chunk);
+            pos += chunk;
+        }
+    }
+
+    return (int)pos;
+}
+
+/*
+Maps up to size bytes at offset as spans pointing straight into the image,
+one per run of physically consecutive clusters. Buffered and staged writes
+the range reaches are emitted first. Spans see later writes to the same
+clusters and stay valid until FAT_unmap_content or DSK_host_close.
+Returns the span count (0 past the end of file) or a negative error.
+*/
+int FAT_map_content(int ci, unsigned int offset, unsigned int size, ContentSpan_t** spans) {
+    *spans = NULL;
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file) return -1;
+    _async_quiesce(ci);
+
+    unsigned int file_size = _content_size(c);
+    if (offset >= file_size || size == 0) return 0;
+    if (size > file_size - offset) size = file_size - offset;
+
+    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    if (c->wbuf_size > 0 && offset + size > MIN(c->wbuf_offset, (unsigned int)c->file->data_size * cluster_bytes)) {
+        if (_content_flush_wbuf(ci) != 0) return -2;
+    }
+
+    if (c->delalloc_size > 0 && offset + size > (unsigned int)c->file->data_size * cluster_bytes) {
+        if (_content_flush_delalloc(ci) != 0) return -2;
+    }
+
+    unsigned int cluster_seek   = offset / cluster_bytes;
+    unsigned int in_cluster_off = offset % cluster_bytes;
+    unsigned int data_size      = (unsigned int)c->file->data_size;
+    if (cluster_seek >= data_size) return 0;
+
+    ContentSpan_t* out = malloc((size_t)(data_size - cluster_seek) * sizeof(ContentSpan_t));
+    if (!out) return -3;
+
+    int count = 0;
+    unsigned int pos = 0;
+    while (pos < size && cluster_seek < data_size) {
+        unsigned int run = 1;
+        unsigned int span = cluster_bytes - in_cluster_off;
+        while (span < size - pos && cluster_seek + run < data_size && c->file->data[cluster_seek + run] == c->file->data[cluster_seek] + run) {
+            span += cluster_bytes;
+            run++;
+        }
+
+        unsigned int chunk = MIN(size - pos, span);
+        unsigned int lba = (c->file->data[cluster_seek] - 2) * FAT_data.sectors_per_cluster + FAT_data.first_data_sector;
+        out[count].data = DSK_map_bytes(lba, in_cluster_off, chunk);
+        if (!out[count].data) {
+            printf("Function FAT_map_content: mapping the image failed. Aborting...\n");
+            free(out);
+            return -4;
+        }
+
+        out[count++].size = chunk;
+        pos += chunk;
+        cluster_seek += run;
+        in_cluster_off = 0;
+    }
+
+    *spans = out;
+    return count;
+}
+
+void FAT_unmap_content(ContentSpan_t* spans) {
+    free(spans);
+}
+
+/* Position inside a caller's I/O vector. */
+typedef struct {
+    const struct iovec* iov;
+    int count;
+    int index;
+    size_t skip;            // bytes of iov[index] already consumed
+} _iov_cursor_t;
+
+/* Points out at the next size bytes of the vector and advances; returns the entry count. */
+static int _iov_take(_iov_cursor_t* cursor, size_t size, struct iovec* out) {
+    int n = 0;
+    while (size > 0 && cursor->index < cursor->count) {
+        const struct iovec* item = &cursor->iov[cursor->index];
+        size_t chunk = MIN(size, item->iov_len - cursor->skip);
+        if (chunk > 0) {
+            out[n].iov_base = (unsigned char*)item->iov_base + cursor->skip;
+            out[n].iov_len  = chunk;
+            n++;
+        }
+
+        size -= chunk;
+        cursor->skip += chunk;
+        if (cursor->skip == item->iov_len) {
+            cursor->index++;
+            cursor->skip = 0;
+        }
+    }
+
+    return n;
+}
+
+static unsigned int _iov_total(const struct iovec* iov, int iovcnt) {
+    uint64_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    return (total > UINT_MAX) ? UINT_MAX : (unsigned int)total;
+}
+
+/*
+Moves size bytes at offset between the file and the vector, one preadv or
+pwritev per run of physically consecutive clusters. Returns the bytes moved.
+*/
+static unsigned int _content_transfer_v(Content* c, _iov_cursor_t* cursor, struct iovec* slice, unsigned int offset, unsigned int size, int write) {
+    unsigned int cluster_bytes  = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    unsigned int idx            = offset / cluster_bytes;
+    unsigned int in_cluster_off = offset % cluster_bytes;
+    unsigned int data_size      = (unsigned int)c->file->data_size;
+
+    unsigned int pos = 0;
+    while (pos < size && idx < data_size) {
+        unsigned int run = 1;
+        unsigned int span = cluster_bytes - in_cluster_off;
+        while (span < size - pos && idx + run < data_size && c->file->data[idx + run] == c->file->data[idx] + run) {
+            span += cluster_bytes;
+            run++;
+        }
+
+        unsigned int chunk = MIN(size - pos, span);
+        unsigned int lba = (c->file->data[idx] - 2) * FAT_data.sectors_per_cluster + FAT_data.first_data_sector;
+        int n = _iov_take(cursor, chunk, slice);
+        int ok = write ? DSK_writev_bytes(lba, in_cluster_off, slice, n) : DSK_readv_bytes(lba, in_cluster_off, slice, n);
+        if (!ok) break;
+
+        pos += chunk;
+        idx += run;
+        in_cluster_off = 0;
+    }
+
+    return pos;
+}
+
+/* Scatter read: fills the vector in order from offset. Returns the bytes read, or a negative error. */
+int FAT_readv(int ci, const struct iovec* iov, int iovcnt, unsigned int offset) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file || iovcnt < 0 || (iovcnt > 0 && !iov)) return -1;
+    _async_quiesce(ci);
+
+    unsigned int file_size = _content_size(c);
+    unsigned int size = _iov_total(iov, iovcnt);
+    if (offset >= file_size || size == 0) return 0;
+    if (size > file_size - offset) size = file_size - offset;
+
+    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    if (c->wbuf_size > 0 && offset + size > MIN(c->wbuf_offset, (unsigned int)c->file->data_size * cluster_bytes)) {
+        if (_content_flush_wbuf(ci) != 0) return -2;
+    }
+
+    struct iovec* slice = malloc((size_t)iovcnt * sizeof(struct iovec));
+    if (!slice) return -3;
+
+    _iov_cursor_t cursor = { .iov = iov, .count = iovcnt };
+    unsigned int pos = _content_transfer_v(c, &cursor, slice, offset, size, 0);
+
+    /* Staged bytes past the allocated tail only live in memory. */
+    unsigned int alloc_end = (unsigned int)c->file->data_size * cluster_bytes;
+    if (pos < size && c->delalloc_size > 0 && offset + pos >= alloc_end) {
+        unsigned int at = offset + pos - alloc_end;
+        if (at < c->delalloc_size) {
+            unsigned int chunk = MIN(size - pos, c->delalloc_size - at);
+            int n = _iov_take(&cursor, chunk, slice);
+            for (int i = 0; i < n; i++) {
+                memcpy(slice[i].iov_base, c->delalloc + at, slice[i].iov_len);
+                at += (unsigned int)slice[i].iov_len;
+            }
+
+            pos += chunk;
+        }
+    }
+
+    free(slice);
+    return (int)pos;
+}
+
+/* Gather write: writes the vector in order at offset. Returns the bytes written, or a negative error. */
+int FAT_writev(int ci, const struct iovec* iov, int iovcnt, unsigned int offset) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file || iovcnt < 0 || (iovcnt > 0 && !iov)) return -1;
+    _async_quiesce(ci);
+
+    unsigned int size = _iov_total(iov, iovcnt);
+    if (size == 0) return 0;
+    if (_content_flush_wbuf(ci) != 0) return -2;
+
+    struct iovec* slice = malloc((size_t)iovcnt * sizeof(struct iovec));
+    if (!slice) return -3;
+
+    /* On a delalloc handle the part past the allocated tail is staged piece by piece. */
+    unsigned int direct = size;
+    unsigned int alloc_end = (unsigned int)c->file->data_size * FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    if (c->delalloc_enabled && offset + size > alloc_end) {
+        if (_content_zero_gap(c, offset) != 0) {
+            free(slice);
+            return -4;
+        }
+
+        direct = (offset < alloc_end) ? alloc_end - offset : 0;
+
+        _iov_cursor_t staged = { .iov = iov, .count = iovcnt };
+        _iov_take(&staged, direct, slice);
+
+        unsigned int at = offset + direct - alloc_end;
+        int n = _iov_take(&staged, size - direct, slice);
+        for (int i = 0; i < n; i++) {
+            if (_content_stage(c, slice[i].iov_base, at, (unsigned int)slice[i].iov_len) != 0) {
+                free(slice);
+                return -4;
+            }
+
+            at += (unsigned int)slice[i].iov_len;
+        }
+
+        c->meta_dirty = 1;
+        if (c->delalloc_size >= DELALLOC_LIMIT && _content_flush_delalloc(ci) != 0) {
+            free(slice);
+            return -4;
+        }
+    }
+
+    unsigned int pos = 0;
+    if (direct > 0) {
+        int prepared = _content_write_prepare(ci, NULL, offset, &direct);
+        if (prepared < 0) {
+            free(slice);
+            return prepared;
+        }
+
+        _iov_cursor_t cursor = { .iov = iov, .count = iovcnt };
+        pos = _content_transfer_v(c, &cursor, slice, offset, direct, 1);
+        if (pos > 0) c->meta_dirty = 1;
+        if (offset + pos > c->meta.file_size) c->meta.file_size = offset + pos;
+    }
+
+    free(slice);
+    return (pos < direct) ? (int)pos : (int)size;
+}
+
+/* Zeroes bytes [from, to) of the file's allocated chain. */
+static int _content_zero_range(Content* c, unsigned int from, unsigned int to) {
+    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    unsigned char* zero = calloc(1, cluster_bytes);
+    if (!zero) return -1;
+
+    int result = 0;
+    while (from < to) {
+        unsigned int in_cluster = from % cluster_bytes;
+        unsigned int chunk = MIN(to - from, cluster_bytes - in_cluster);
+        if (_cluster_run_write(zero, c->file->data[from / cluster_bytes], 1, in_cluster, chunk) != 0) {
+            result = -1;
+            break;
+        }
+
+        from += chunk;
+    }
+
+    free(zero);
+    return result;
+}
+
+/*
+Zeroes the allocated bytes between the end of file and offset before a write
+past the end, so reserved or partially used clusters never expose old data.
+*/
+static int _content_zero_gap(Content* c, unsigned int offset) {
+    unsigned int alloc_end = (unsigned int)c->file->data_size * FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    unsigned int to = MIN(offset, alloc_end);
+    unsigned int file_size = _content_size(c);
+    if (file_size >= to) return 0;
+    return _content_zero_range(c, file_size, to);
+}
+
+/*
+Gets a file ready for an in-place write of *size bytes at offset. On a
+delalloc handle the part past the allocated tail is staged and *size shrinks
+to the rest. The chain is then grown over the write, and new clusters are
+zeroed where the write leaves them uncovered. Returns 0 to go on, 1 when
+nothing is left to write in place, or a negative error.
+*/
+static int _content_write_prepare(int ci, const unsigned char* buffer, unsigned int offset, unsigned int* psize) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file) return -1;
+
+    unsigned int size = *psize;
+    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    if (_content_zero_gap(c, offset) != 0) return -3;
+
+    if (c->delalloc_enabled) {
+        unsigned int alloc_end = (unsigned int)c->file->data_size * cluster_bytes;
+        if (offset + size > alloc_end) {
+            unsigned int direct = (offset < alloc_end) ? alloc_end - offset : 0;
+            if (_content_stage(c, buffer + direct, offset + direct - alloc_end, size - direct) != 0) return -3;
+            c->meta_dirty = 1;
+
+            size = *psize = direct;
+            if (c->delalloc_size >= DELALLOC_LIMIT && _content_flush_delalloc(ci) != 0) return -3;
+            if (size == 0) return 1;
+        }
+    }
+
+    unsigned int cluster_seek = offset / cluster_bytes;
+
+    /* The chain is grown to cover the whole write first, so appended clusters join the runs below. */
+    unsigned int grown_from = (unsigned int)c->file->data_size;
+    unsigned int last_idx = (unsigned int)(((uint64_t)offset + (size ? size : 1) - 1) / cluster_bytes);
+    while ((unsigned int)c->file->data_size <= last_idx) {
+        unsigned int before = (unsigned int)c->file->data_size;
+        _add_cluster_to_content(ci);
+        if ((unsigned int)c->file->data_size == before) break;
+    }
+
+    if ((unsigned int)c->file->data_size <= cluster_seek) return -2;
+
+    /* New clusters are zeroed only where this write leaves them uncovered. */
+    if ((unsigned int)c->file->data_size > grown_from) {
+        unsigned int grown_start = grown_from * cluster_bytes;
+        unsigned int grown_end   = (unsigned int)c->file->data_size * cluster_bytes;
+        if (offset > grown_start && _content_zero_range(c, grown_start, offset) != 0) return -3;
+        if (offset + size < grown_end && _content_zero_range(c, MAX(offset + size, grown_start), grown_end) != 0) return -3;
+    }
+
+    return 0;
+}
+
+/* Writes size bytes at offset. Returns the bytes written, short only on a disk error, or a negative error. */
+static int _content_write(int ci, const unsigned char* buffer, unsigned int offset, unsigned int size) {
+    unsigned int total = size;
+    int prepared = _content_write_prepare(ci, buffer, offset, &size);
+    if (prepared < 0) return prepared;
+    if (prepared == 1) return (int)total;
+
+    Content* c = FAT_get_content_from_table(ci);
+    unsigned int cluster_bytes  = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    unsigned int cluster_seek   = offset / cluster_bytes;
+    unsigned int in_cluster_off = offset % cluster_bytes;
+
+    /* Each run of physically consecutive clusters is one write from the caller's buffer. */
+    unsigned int pos = 0;
+    unsigned int idx = cluster_seek;
+    unsigned int data_size = (unsigned int)c->file->data_size;
+    while (pos < size && idx < data_size) {
+        unsigned int run = 1;
+        unsigned int span = cluster_bytes - in_cluster_off;
+        while (span < size - pos && idx + run < data_size && c->file->data[idx + run] == c->file->data[idx] + run) {
+            span += cluster_bytes;
+            run++;
+        }
+
+        unsigned int chunk = MIN(size - pos, span);
+        if (_cluster_run_write(buffer + pos, c->file->data[idx], run, in_cluster_off, chunk) != 0) {
+            return (int)pos;
+        }
+
+        pos += chunk;
+        idx += run;
+        in_cluster_off = 0;
+    }
+
+    if (pos > 0) c->meta_dirty = 1;
+    if (pos < size) {
+        if (offset + pos > c->meta.file_size) c->meta.file_size = offset + pos;
+        return (int)pos;
+    }
+
+    unsigned int end_pos = offset + size;
+    if (end_pos > c->meta.file_size) c->meta.file_size = end_pos;
+
+    return (int)total;
+}
+
+static int _content_flush_wbuf(int ci) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || c->wbuf_size == 0) return 0;
+
+    /* Taken out of the handle first, so the write sees the old end of file and zeroes any gap up to the buffer. */
+    unsigned int size = c->wbuf_size;
+    c->wbuf_size = 0;
+    if (_content_write(ci, c->wbuf, c->wbuf_offset, size) != (int)size) {
+        c->wbuf_size = size;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+Small writes that continue the buffered range are merged in the handle's
+buffer. The buffer ends on a cluster boundary, so it is emitted as whole
+clusters once full; any other write, a flush or an overlapping read emits
+it first. Writes at least as large as the buffer go straight to disk.
+Returns the bytes written, short only on a disk error, or a negative error.
+*/
+int FAT_write_buffer2content(int ci, const unsigned char* buffer, unsigned int offset, unsigned int size) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file) return -1;
+    _async_quiesce(ci);
+    if (c->wbuf_capacity == 0 || size == 0) return _content_write(ci, buffer, offset, size);
+
+    if (c->wbuf_size > 0 && offset != c->wbuf_offset + c->wbuf_size) {
+        if (_content_flush_wbuf(ci) != 0) return -3;
+    }
+
+    unsigned int done = 0;
+    while (done < size) {
+        unsigned int at = offset + done;
+        unsigned int start = (c->wbuf_size > 0) ? c->wbuf_offset : at;
+        unsigned int limit = c->wbuf_capacity - start % FAT_data.cluster_size;
+        if (c->wbuf_size == 0) {
+            if (size - done >= limit || (!c->wbuf && !(c->wbuf = malloc(c->wbuf_capacity)))) {
+                int written = _content_write(ci, buffer + done, at, size - done);
+                if (written < 0) return done ? (int)done : written;
+                return (int)(done + (unsigned int)written);
+            }
+
+            c->wbuf_offset = at;
+        }
+
+        unsigned int take = MIN(size - done, limit - c->wbuf_size);
+        memcpy(c->wbuf + c->wbuf_size, buffer + done, take);
+        c->wbuf_size += take;
+        c->meta_dirty = 1;
+
+        if (c->wbuf_size == limit && _content_flush_wbuf(ci) != 0) return -3;
+        done += take;
+    }
+
+    return (int)done;
+}
+
+/* Reads at the handle's cursor and advances it. Returns the bytes read, or a negative error. */
+int FAT_read(int ci, unsigned char* buffer, unsigned int size) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file) return -1;
+
+    int result = FAT_read_content2buffer(ci, buffer, c->position, size);
+    if (result > 0) c->position += (unsigned int)result;
+    return result;
+}
+
+/* Writes at the handle's cursor and advances it. Returns the bytes written, or a negative error. */
+int FAT_write(int ci, const unsigned char* buffer, unsigned int size) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file) return -1;
+
+    int result = FAT_write_buffer2content(ci, buffer, c->position, size);
+    if (result > 0) c->position += (unsigned int)result;
+    return result;
+}
+
+/*
+Moves the cursor like lseek. Positions past the end of file are allowed; a
+write there zeroes the gap first. Returns the new position.
+*/
+long long FAT_seek(int ci, long long offset, int whence) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file) return -1;
+
+    long long base = 0;
+    if (whence == SEEK_CUR) base = c->position;
+    else if (whence == SEEK_END) base = _content_size(c);
+    else if (whence != SEEK_SET) return -2;
+
+    long long position = base + offset;
+    if (position < 0 || position > UINT_MAX) return -2;
+
+    c->position = (unsigned int)position;
+    return position;
+}
+
+/* Sets the handle's write buffer size, rounded up to whole clusters; 0, the default, turns buffering off. */
+int FAT_set_write_buffer(int ci, unsigned int size) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || c->content_type != CONTENT_TYPE_FILE) return -1;
+    if (_content_flush_wbuf(ci) != 0) return -2;
+
+    unsigned int capacity = (unsigned int)(((uint64_t)size + FAT_data.cluster_size - 1) / FAT_data.cluster_size) * FAT_data.cluster_size;
+    if (capacity != c->wbuf_capacity) {
+        free(c->wbuf);
+        c->wbuf = NULL;
+        c->wbuf_capacity = capacity;
+    }
+
+    return 0;
+}
+
+/*
+Reserves clusters for the first size bytes of a file without changing its size
+(contents past the end of file stay undefined). A single free run is preferred,
+searched from the cluster after the current tail, and its FAT entries are
+written in one batch; otherwise the file grows one cluster at a time.
+*/
+static int _content_reserve(int ci, unsigned int size) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || c->content_type != CONTENT_TYPE_FILE || !c->file || !c->file->data || c->file->data_size <= 0) return -1;
+
+    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    unsigned int need = (unsigned int)(((uint64_t)size + cluster_bytes - 1) / cluster_bytes);
+    if (need <= (unsigned int)c->file->data_size) return 0;
+
+    unsigned int count = need - (unsigned int)c->file->data_size;
+    unsigned int last  = c->file->data[c->file->data_size - 1];
+
+    unsigned int* data = realloc(c->file->data, need * sizeof(unsigned int));
+    if (!data) return -2;
+    c->file->data = data;
+
+    unsigned int first = 0;
+    _fat_batch_begin();
+    int linked = _cluster_find_free_run(count, last + 1, &first) == 0 && _cluster_claim_run(first, count) == 0;
+    if (linked && __write_fat(last, first) != 0) {
+        _chain_free(first);
+        linked = 0;
+    }
+
+    if (_fat_batch_end() != 0) {
+        printf("Function FAT_fallocate: writing FAT batch failed. Aborting...\n");
+        return -3;
+    }
+
+    if (linked) {
+        for (unsigned int i = 0; i < count; i++) data[c->file->data_size + i] = first + i;
+        c->file->data_size = (int)need;
+
+        _alloc_group_release(c->alloc_group);
+        c->alloc_group = -1;
+        return 0;
+    }
+
+    while ((unsigned int)c->file->data_size < need) {
+        int before = c->file->data_size;
+        _add_cluster_to_content(ci);
+        if (c->file->data_size == before) return -4;
+    }
+
+    return 0;
+}
+
+/*
+Size of the file as the handle sees it. Staged and buffered bytes only count
+towards the directory entry once they are on disk, so they extend it here instead.
+*/
+static unsigned int _content_size(Content* c) {
+    unsigned int size = c->meta.file_size;
+    if (c->file && c->delalloc_size > 0) {
+        unsigned int staged_end = (unsigned int)c->file->data_size * FAT_data.sectors_per_cluster * SECTOR_SIZE + c->delalloc_size;
+        if (staged_end > size) size = staged_end;
+    }
+
+    if (c->wbuf_size > 0 && c->wbuf_offset + c->wbuf_size > size) size = c->wbuf_offset + c->wbuf_size;
+    return size;
+}
+
+/* Copies bytes past the allocated tail into the handle's staging buffer; at is relative to that tail. */
+static int _content_stage(Content* c, const unsigned char* data, unsigned int at, unsigned int size) {
+    unsigned int end = at + size;
+    if (end > c->delalloc_capacity) {
+        unsigned int capacity = c->delalloc_capacity ? c->delalloc_capacity : FAT_data.cluster_size;
+        while (capacity < end) capacity *= 2;
+
+        unsigned char* staged = realloc(c->delalloc, capacity);
+        if (!staged) return -1;
+        c->delalloc = staged;
+        c->delalloc_capacity = capacity;
+    }
+
+    if (at > c->delalloc_size) memset(c->delalloc + c->delalloc_size, 0, at - c->delalloc_size);
+    memcpy(c->delalloc + at, data, size);
+    if (end > c->delalloc_size) c->delalloc_size = end;
+    return 0;
+}
+
+/*
+Allocates the staged tail in one request sized to the data, then writes it
+out as whole clusters, zero-padded past the data. The file size only grows
+once every cluster is written.
+*/
+static int _content_flush_delalloc(int ci) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || !c->file || c->delalloc_size == 0) return 0;
+
+    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+    unsigned int base = (unsigned int)c->file->data_size;
+    unsigned int end = base * cluster_bytes + c->delalloc_size;
+    if (_content_reserve(ci, end) != 0) return -1;
+
+    /* The staging buffer always holds whole clusters, so the pad fits. */
+    unsigned int padded = (c->delalloc_size + cluster_bytes - 1) / cluster_bytes * cluster_bytes;
+    memset(c->delalloc + c->delalloc_size, 0, padded - c->delalloc_size);
+    for (unsigned int pos = 0; pos < padded; pos += cluster_bytes) {
+        if (_cluster_writeoff(c->delalloc + pos, c->file->data[base + pos / cluster_bytes], 0, cluster_bytes) != 0) return -2;
+    }
+
+    if (end > c->meta.file_size) c->meta.file_size = end;
+    c->meta_dirty = 1;
+    c->delalloc_size = 0;
+    return 0;
+}
+
+int FAT_fallocate(int ci, unsigned int size) {
+    if (_content_flush_delalloc(ci) != 0) return -5;
+    return _content_reserve(ci, size);
+}
+
+int FAT_set_delalloc(int ci, int enabled) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c || c->content_type != CONTENT_TYPE_FILE) return -1;
+
+    if (!enabled && _content_flush_delalloc(ci) != 0) return -2;
+    c->delalloc_enabled = enabled ? 1 : 0;
+    return 0;
+}
+
+/* Writes a file's size and modification time back to its directory entry in one slot write. */
+static int _content_write_meta(Content* c) {
+    if (!c->meta_dirty) return 0;
+    if (c->content_type != CONTENT_TYPE_FILE || c->entry_cluster == 0) return 0;
+
+    c->meta.last_accessed          = DTM_current_date();
+    c->meta.last_modification_date = DTM_current_date();
+    c->meta.last_modification_time = DTM_current_time();
+    if (_directory_entry_write(c->entry_cluster, c->entry_index, &c->meta) != 0) return -1;
+
+    c->meta_dirty = 0;
+    return 0;
+}
+
+/*
+Writes back everything a handle holds in memory: staged data, its directory
+entry and the FAT. Data reaches stable storage only through DSK_sync or the
+disk sync policy.
+*/
+int FAT_flush(int ci) {
+    Content* c = FAT_get_content_from_table(ci);
+    if (!c) return -1;
+
+    _async_quiesce(ci);
+    if (_content_flush_wbuf(ci) != 0) return -2;
+    if (_content_flush_delalloc(ci) != 0) return -2;
+    if (_content_write_meta(c) != 0) {
+        printf("Function FAT_flush: writing directory entry failed. Aborting...\n");
+        return -3;
+    }
+
+    if (_fat_flush_dirty() != 0) return -4;
+    return 0;
+}
+
+/* Flushes every open handle, then makes the image durable. */
+int FAT_sync() {
+    int result = 0;
+    for (int i = 0; i < CONTENT_TABLE_SIZE; i++) {
+        if (_content_table[i] && FAT_flush(i) != 0) result = -1;
+    }
+
+    if (_fat_flush_dirty() != 0) result = -1;
+    if (DSK_sync() != 1) result = -2;
+    return result;
+}
+
+/*
+Asynchronous I/O. A request is resolved on the submitting thread: the chain
+is grown for writes and the range is split into runs of physically
+consecutive clusters, one device I/O each. The runs are queued to a pool of
+workers, so many requests and runs are in flight at once. A request
+completes when its last run does; completions go to the callback or to a
+queue drained by FAT_async_poll/FAT_async_wait.
+*/
+typedef struct _async_request {
+	AsyncCompletion_t completion;
+	Content* content;
+	int write;
+	atomic_uint pending;            // runs not finished, plus one while submitting
+	atomic_uint fail_at;            // request offset of the first failed byte, UINT_MAX - none
+	struct _async_request* next;
+} _async_request_t;
+
+typedef struct _async_io {
+	_async_request_t* request;
+	unsigned int cluster;
+	unsigned int count;             // clusters in the run
+	unsigned int offset;
+	unsigned int size;
+	unsigned int at;                // offset of the run within the request
+	unsigned char* data;
+	struct _async_io* next;
+} _async_io_t;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;            // runs queued or stopping
+	pthread_cond_t done;            // a request completed
+	pthread_t threads[ASYNC_MAX_THREADS];
+	unsigned int workers;
+	int running;
+	int stopping;
+	async_callback_t callback;
+	void* ctx;
+	int next_ticket;
+	unsigned int inflight;          // requests submitted and not completed
+	_async_io_t* io_head;
+	_async_io_t* io_tail;
+	_async_request_t* done_head;
+	_async_request_t* done_tail;
+} _async = { .lock = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER };
+
+/* Records a failure at request offset at; the result is cut back to the bytes before the first one. */
+static void _async_fail(_async_request_t* request, unsigned int at) {
+	unsigned int current = atomic_load(&request->fail_at);
+	while (at < current && !atomic_compare_exchange_weak(&request->fail_at, &current, at));
+}
+
+static void _async_complete(_async_request_t* request) {
+	Content* content = request->content;
+	unsigned int fail_at = atomic_load(&request->fail_at);
+	if (fail_at < (unsigned int)request->completion.result) request->completion.result = fail_at ? (int)fail_at : -3;
+
+	if (_async.callback) {
+		_async.callback(&request->completion, _async.ctx);
+		free(request);
+		request = NULL;
+	}
+
+	pthread_mutex_lock(&_async.lock);
+	if (request) {
+		if (_async.done_tail) _async.done_tail->next = request;
+		else _async.done_head = request;
+		_async.done_tail = request;
+	}
+
+	_async.inflight--;
+	content->async_inflight--;
+	pthread_cond_broadcast(&_async.done);
+	pthread_mutex_unlock(&_async.lock);
+}
+
+static inline void _async_release(_async_request_t* request) {
+	if (atomic_fetch_sub(&request->pending, 1) == 1) _async_complete(request);
+}
+
+static void* _async_worker(void* arg) {
+	(void)arg;
+
+	pthread_mutex_lock(&_async.lock);
+	for (;;) {
+		while (!_async.io_head && !_async.stopping) pthread_cond_wait(&_async.work, &_async.lock);
+		_async_io_t* io = _async.io_head;
+		if (!io) break;
+
+		_async.io_head = io->next;
+		if (!_async.io_head) _async.io_tail = NULL;
+		pthread_mutex_unlock(&_async.lock);
+
+		int result = io->request->write ?
+			_cluster_run_write(io->data, io->cluster, io->count, io->offset, io->size) :
+			_cluster_run_read(io->cluster, io->offset, io->data, io->size);
+		if (result != 0) _async_fail(io->request, io->at);
+
+		_async_release(io->request);
+		free(io);
+		pthread_mutex_lock(&_async.lock);
+	}
+
+	pthread_mutex_unlock(&_async.lock);
+	return NULL;
+}
+
+/* Starts the I/O workers; callback NULL - completions are queued for FAT_async_poll/FAT_async_wait. */
+int FAT_async_start(int threads, async_callback_t callback, void* ctx) {
+	if (_async.running) return -1;
+
+	/* Workers spend their time blocked in pread/pwrite, so the default is a few per CPU. */
+	if (threads <= 0) threads = 4 * (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0) threads = 4;
+	if (threads > ASYNC_MAX_THREADS) threads = ASYNC_MAX_THREADS;
+
+	_async.callback = callback;
+	_async.ctx      = ctx;
+	_async.stopping = 0;
+	_async.workers  = 0;
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&_async.threads[_async.workers], NULL, _async_worker, NULL) != 0) break;
+		_async.workers++;
+	}
+
+	if (_async.workers == 0) {
+		printf("Function FAT_async_start: starting I/O workers failed. Aborting...\n");
+		return -2;
+	}
+
+	_async.running = 1;
+	return 0;
+}
+
+/* Waits for every submitted request, joins the workers and drops uncollected completions. */
+int FAT_async_stop() {
+	if (!_async.running) return 0;
+
+	pthread_mutex_lock(&_async.lock);
+	_async.stopping = 1;
+	pthread_cond_broadcast(&_async.work);
+	pthread_mutex_unlock(&_async.lock);
+	for (unsigned int i = 0; i < _async.workers; i++) pthread_join(_async.threads[i], NULL);
+
+	while (_async.done_head) {
+		_async_request_t* next = _async.done_head->next;
+		free(_async.done_head);
+		_async.done_head = next;
+	}
+
+	_async.done_tail = NULL;
+	_async.running   = 0;
+	return 0;
+}
+
+/* Waits for the requests in flight on handle ci, or on every handle when ci is negative. */
+static void _async_quiesce(int ci) {
+	if (!_async.running) return;
+
+	Content* c = (ci >= 0) ? FAT_get_content_from_table(ci) : NULL;
+	if (ci >= 0 && !c) return;
+
+	pthread_mutex_lock(&_async.lock);
+	while (c ? c->async_inflight > 0 : _async.inflight > 0) pthread_cond_wait(&_async.done, &_async.lock);
+	pthread_mutex_unlock(&_async.lock);
+}
+
+static _async_request_t* _async_request(int ci, unsigned char* buffer, int write) {
+	if (!_async.running && FAT_async_start(0, NULL, NULL) != 0) return NULL;
+
+	_async_request_t* request = calloc(1, sizeof(_async_request_t));
+	if (!request) return NULL;
+
+	request->completion.ci     = ci;
+	request->completion.buffer = buffer;
+	request->content = FAT_get_content_from_table(ci);
+	request->write   = write;
+	atomic_init(&request->pending, 1);
+	atomic_init(&request->fail_at, UINT_MAX);
+
+	pthread_mutex_lock(&_async.lock);
+	request->completion.ticket = ++_async.next_ticket;
+	_async.inflight++;
+	request->content->async_inflight++;
+	pthread_mutex_unlock(&_async.lock);
+	return request;
+}
+
+/* Queues one device I/O per run of physically consecutive clusters covering size bytes at offset. */
+static unsigned int _async_queue_runs(_async_request_t* request, Content* c, unsigned char* data, unsigned int offset, unsigned int size) {
+	unsigned int cluster_bytes  = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+	unsigned int idx            = offset / cluster_bytes;
+	unsigned int in_cluster_off = offset % cluster_bytes;
+	unsigned int data_size      = (unsigned int)c->file->data_size;
+
+	_async_io_t* head = NULL;
+	_async_io_t* tail = NULL;
+	unsigned int pos = 0;
+	while (pos < size && idx < data_size) {
+		unsigned int run = 1;
+		unsigned int span = cluster_bytes - in_cluster_off;
+		while (span < size - pos && idx + run < data_size && c->file->data[idx + run] == c->file->data[idx] + run) {
+			span += cluster_bytes;
+			run++;
+		}
+
+		_async_io_t* io = malloc(sizeof(_async_io_t));
+		if (!io) {
+			_async_fail(request, pos);
+			break;
+		}
+
+		unsigned int chunk = MIN(size - pos, span);
+		*io = (_async_io_t){ .request = request, .cluster = c->file->data[idx], .count = run, .offset = in_cluster_off, .size = chunk, .at = pos, .data = data + pos };
+		if (tail) tail->next = io;
+		else head = io;
+		tail = io;
+
+		atomic_fetch_add(&request->pending, 1);
+		pos += chunk;
+		idx += run;
+		in_cluster_off = 0;
+	}
+
+	if (head) {
+		pthread_mutex_lock(&_async.lock);
+		if (_async.io_tail) _async.io_tail->next = head;
+		else _async.io_head = head;
+		_async.io_tail = tail;
+		pthread_cond_broadcast(&_async.work);
+		pthread_mutex_unlock(&_async.lock);
+	}
+
+	return pos;
+}
+
+/*
+Submits a read of up to size bytes at offset into buffer, which must stay
+valid until the request completes. Returns a ticket, or a negative error.
+*/
+int FAT_read_async(int ci, unsigned char* buffer, unsigned int offset, unsigned int size) {
+	Content* c = FAT_get_content_from_table(ci);
+	if (!c || !c->file) return -1;
+
+	unsigned int file_size = _content_size(c);
+	if (offset >= file_size) size = 0;
+	else if (size > file_size - offset) size = file_size - offset;
+
+	unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+	unsigned int alloc_end = (unsigned int)c->file->data_size * cluster_bytes;
+	if (size > 0 && c->wbuf_size > 0 && offset + size > MIN(c->wbuf_offset, alloc_end)) {
+		if (_content_flush_wbuf(ci) != 0) return -2;
+		alloc_end = (unsigned int)c->file->data_size * cluster_bytes;
+	}
+
+	_async_request_t* request = _async_request(ci, buffer, 0);
+	if (!request) return -3;
+
+	unsigned int pos = _async_queue_runs(request, c, buffer, offset, size);
+
+	/* Staged bytes past the allocated tail only live in memory. */
+	if (pos < size && c->delalloc_size > 0 && offset + pos >= alloc_end) {
+		unsigned int at = offset + pos - alloc_end;
+		if (at < c->delalloc_size) {
+			unsigned int chunk = MIN(size - pos, c->delalloc_size - at);
+			memcpy(buffer + pos, c->delalloc + at, chunk);
+			pos += chunk;
+		}
+	}
+
+	request->completion.result = (int)pos;
+	int ticket = request->completion.ticket;
+	_async_release(request);
+	return ticket;
+}
+
+/*
+Submits a write of size bytes at offset from buffer, which must stay valid
+until the request completes. The chain and the file size are updated before
+this returns; only the data transfer is deferred. Bytes staged on a delalloc
+handle count as written, as in FAT_write_buffer2content. Returns a ticket, or
+a negative error.
+*/
+int FAT_write_async(int ci, const unsigned char* buffer, unsigned int offset, unsigned int size) {
+	Content* c = FAT_get_content_from_table(ci);
+	if (!c || !c->file) return -1;
+	if (_content_flush_wbuf(ci) != 0) return -2;
+
+	unsigned int direct = size;
+	int prepared = (size > 0) ? _content_write_prepare(ci, buffer, offset, &direct) : 1;
+	if (prepared < 0) return prepared;
+
+	_async_request_t* request = _async_request(ci, (unsigned char*)buffer, 1);
+	if (!request) return -3;
+
+	unsigned int pos = (prepared == 0) ? _async_queue_runs(request, c, (unsigned char*)buffer, offset, direct) : 0;
+	if (pos < direct) _async_fail(request, pos);
+
+	if (direct > 0) {
+		if (offset + direct > c->meta.file_size) c->meta.file_size = offset + direct;
+		c->meta_dirty = 1;
+	}
+
+	request->completion.result = (int)size;
+	int ticket = request->completion.ticket;
+	_async_release(request);
+	return ticket;
+}
+
+static int _async_take(AsyncCompletion_t* completions, int max) {
+	int count = 0;
+	while (count < max && _async.done_head) {
+		_async_request_t* request = _async.done_head;
+		_async.done_head = request->next;
+		if (!_async.done_head) _async.done_tail = NULL;
+
+		completions[count++] = request->completion;
+		free(request);
+	}
+
+	return count;
+}
+
+/* Collects up to max queued completions without blocking. */
+int FAT_async_poll(AsyncCompletion_t* completions, int max) {
+	pthread_mutex_lock(&_async.lock);
+	int count = _async_take(completions, max);
+	pthread_mutex_unlock(&_async.lock);
+	return count;
+}
+
+/* Blocks until at least one completion is queued; returns 0 once nothing is in flight. */
+int FAT_async_wait(AsyncCompletion_t* completions, int max) {
+	pthread_mutex_lock(&_async.lock);
+	while (!_async.done_head && _async.inflight > 0) pthread_cond_wait(&_async.done, &_async.lock);
+	int count = _async_take(completions, max);
+	pthread_mutex_unlock(&_async.lock);
+	return count;
+}
+
+int FAT_change_meta(const char* path, const char* new_name) {
+	if (FAT_data.fat_type != 32) {
+		printf("Function FAT_change_meta: FAT16 and FAT12 are not supported!\n");
+		return -1;
+	}
+
+	dentry_t dentry;
+	int retVal = _path_resolve(path, &dentry);
+	switch (retVal) {
+		case -2:
+			printf("Function FAT_change_meta: No matching directory found. Aborting...\n");
+			return -2;
+
+		case -1:
+			printf("Function FAT_change_meta: An error occurred in _directory_search. Aborting...\n");
+			return retVal;
+	}
+
+	if (dentry.entry_cluster == 0) {
+		printf("Function FAT_change_meta: the root directory has no entry to edit. Aborting...\n");
+		return -1;
+	}
+
+	directory_entry_t file_info = dentry.entry;
+	if (_directory_edit(dentry.parent_cluster, &file_info, new_name) != 0) {
+		printf("Function FAT_change_meta: _directory_edit encountered an error. Aborting...\n");
+		return -1;
+	}
+
+	if (file_info.attributes & FILE_DIRECTORY) _dcache_reset();
+	else _dcache_forget_location(dentry.entry_cluster, dentry.entry_index);
+	_dcache_forget_negative();
+	return 0;
+}
+
+int FAT_put_content(const char* path, Content* content) {
+	dentry_t parent;
+	int result = _path_resolve(path, &parent);
+	if (result == -2) return -3;
+	if (result != 0) return -4;
+
+	if ((parent.entry.attributes & FILE_DIRECTORY) != FILE_DIRECTORY) {
+		printf("Function FAT_put_content: '%s' is not a directory. Aborting...\n", path);
+		return -2;
+	}
+
+	unsigned int active_cluster = GET_CLUSTER_FROM_ENTRY(parent.entry, FAT_data.fat_type);
+
+	int retVal = _directory_add(active_cluster, &content->meta, content->long_name);
+	if (retVal == -3) {
+		printf("Function FAT_put_content: file='%s' already exists. Aborting...\n", path);
+		return -3;
+	}
+	else if (retVal != 0) {
+		printf("Function FAT_put_content: _directory_add error. Aborting...\n");
+		return -1;
+	}
+
+	char name[13] = { 0 };
+	_fatname2path(content->meta.file_name, name);
+	_dcache_forget_child(path, name);
+	if (content->long_name) _dcache_forget_child(path, content->long_name);
 	return 1;
 }
 
-int FAT_open_content(const char* path) {
-	Content* fat_content = FAT_create_content();
-	if (!fat_content) return -1;
+static int _dir_slot_compare(const void* a, const void* b) {
+	const dir_slot_t* x = (const dir_slot_t*)a;
+	const dir_slot_t* y = (const dir_slot_t*)b;
+	if (x->cluster != y->cluster) return x->cluster < y->cluster ? -1 : 1;
+	if (x->index != y->index) return x->index < y->index ? -1 : 1;
+	return 0;
+}
+
+/* Frees the first clusters _directory_entry_prepare claimed for a batch that is not going to be written. */
+static void _put_contents_release(Content** contents, const unsigned char* fresh, int count) {
+	_fat_batch_begin();
+	for (int i = 0; i < count; i++) {
+		directory_entry_t* meta = &contents[i]->meta;
+		unsigned int cluster = GET_CLUSTER_FROM_PENTRY(meta, FAT_data.fat_type);
+		if (!fresh[i] || cluster < 2) continue;
+
+		_chain_free(cluster);
+		meta->low_bits  = 0;
+		meta->high_bits = 0;
+	}
+
+	_fat_batch_end();
+}
+
+/*
+Creates count entries in one directory. Names are validated once against
+the directory index, missing directory clusters are claimed as one run and
+every dirty directory cluster is written once.
+Returns count on success, -3 if a name is taken, -2 if path is not a directory.
+*/
+int FAT_put_contents(const char* path, Content** contents, int count) {
+	if (count <= 0) return 0;
+
+	dentry_t parent;
+	int result = _path_resolve(path, &parent);
+	if (result == -2) return -3;
+	if (result != 0) return -4;
+
+	if ((parent.entry.attributes & FILE_DIRECTORY) != FILE_DIRECTORY) {
+		printf("Function FAT_put_contents: '%s' is not a directory. Aborting...\n", path);
+		return -2;
+	}
+
+	/* Long names take a run of slots each, so they are added one at a time after the batch. */
+	int long_count = 0;
+	for (int i = 0; i < count; i++) {
+		if (contents[i]->long_name) long_count++;
+	}
+
+	if (long_count) {
+		Content** short_contents = malloc((count - long_count + 1) * sizeof(Content*));
+		if (!short_contents) return -1;
+
+		int short_count = 0;
+		for (int i = 0; i < count; i++) {
+			if (!contents[i]->long_name) short_contents[short_count++] = contents[i];
+		}
+
+		result = short_count ? FAT_put_contents(path, short_contents, short_count) : 0;
+		free(short_contents);
+		if (result < 0) return result;
+
+		for (int i = 0; i < count; i++) {
+			if (!contents[i]->long_name) continue;
+			result = FAT_put_content(path, contents[i]);
+			if (result != 1) return result;
+		}
+
+		return count;
+	}
+
+	unsigned int active_cluster = GET_CLUSTER_FROM_ENTRY(parent.entry, FAT_data.fat_type);
+	dir_index_t* index = _dir_index_acquire(active_cluster);
+	if (!index) {
+		for (int i = 0; i < count; i++) {
+			result = FAT_put_content(path, contents[i]);
+			if (result != 1) return result;
+		}
+
+		return count;
+	}
+
+	/* Names are checked against the directory and, through an open-addressed set, against each other. */
+	unsigned int set_size = 64;
+	while (set_size < (unsigned int)count * 2) set_size <<= 1;
+	int* set = malloc(set_size * sizeof(int));
+	if (!set) return -1;
+	memset(set, -1, set_size * sizeof(int));
+
+	for (int i = 0; i < count; i++) {
+		const unsigned char* name = contents[i]->meta.file_name;
+		int taken = _dir_index_find(index, name) != NULL;
+
+		unsigned int pos = _dir_name_hash(name) & (set_size - 1);
+		while (!taken && set[pos] >= 0) {
+			taken = memcmp(contents[set[pos]]->meta.file_name, name, 11) == 0;
+			pos = (pos + 1) & (set_size - 1);
+		}
+
+		if (taken) {
+			printf("Function FAT_put_contents: file='%.11s' already exists in '%s'. Aborting...\n", name, path);
+			free(set);
+			return -3;
+		}
+
+		set[pos] = i;
+	}
+
+	free(set);
+
+	dir_slot_t* slots = malloc(count * sizeof(dir_slot_t));
+	unsigned char* fresh = calloc(count, sizeof(unsigned char));
+	if (!slots || !fresh) {
+		free(slots);
+		free(fresh);
+		return -1;
+	}
+
+	_fat_batch_begin();
+	for (int i = 0; i < count && result == 0; i++) {
+		directory_entry_t* meta = &contents[i]->meta;
+		fresh[i] = GET_CLUSTER_FROM_PENTRY(meta, FAT_data.fat_type) < 2;
+		result = _directory_entry_prepare(meta);
+	}
+
+	if (_fat_batch_end() != 0 || result != 0) {
+		printf("Function FAT_put_contents: allocation of new cluster failed. Aborting...\n");
+		_put_contents_release(contents, fresh, count);
+		free(slots);
+		free(fresh);
+		return -1;
+	}
+
+	unsigned int entries_per_cluster = FAT_data.cluster_size / sizeof(directory_entry_t);
+	unsigned int taken = 0;
+	while (taken < (unsigned int)count && _dir_index_take_slot(index, &slots[taken].cluster, &slots[taken].index) == 0) taken++;
+
+	/* Whatever the chain can not hold goes to new clusters, claimed as one run when possible. */
+	unsigned int new_first = 0, new_count = 0;
+	if (taken < (unsigned int)count) {
+		new_count = (count - taken + entries_per_cluster - 1) / entries_per_cluster;
+
+		_fat_batch_begin();
+		unsigned int run_first = 0;
+		if (_cluster_find_free_run(new_count, index->last_cluster + 1, &run_first) == 0 && _cluster_claim_run(run_first, new_count) == 0) {
+			new_first = run_first;
+		}
+
+		int linked = new_first && __write_fat(index->last_cluster, new_first) == 0;
+		if (_fat_batch_end() != 0 || !linked) {
+			if (new_first) _chain_free(new_first);
+			new_first = 0;
+		}
+
+		if (new_first) {
+			for (unsigned int i = taken; i < (unsigned int)count; i++) {
+				slots[i].cluster = new_first + (i - taken) / entries_per_cluster;
+				slots[i].index   = (i - taken) % entries_per_cluster;
+			}
+
+			unsigned int used = (count - taken) % entries_per_cluster;
+			index->last_cluster = new_first + new_count - 1;
+			index->end_cluster  = used ? index->last_cluster : 0;
+			index->end_index    = used;
+		}
+		else {
+			new_count = 0;
+			while (taken < (unsigned int)count) {
+				unsigned int extension = _directory_extend(index->last_cluster);
+				if (!extension) {
+					printf("Function FAT_put_contents: extension of the cluster chain with new cluster failed. Aborting...\n");
+					_dir_index_drop(active_cluster);
+					_put_contents_release(contents, fresh, count);
+					free(slots);
+					free(fresh);
+					return -1;
+				}
+
+				index->last_cluster = extension;
+				index->end_cluster  = extension;
+				index->end_index    = 0;
+				while (taken < (unsigned int)count && _dir_index_take_slot(index, &slots[taken].cluster, &slots[taken].index) == 0) taken++;
+			}
+		}
+	}
+
+	/* Slots are handed out in chain order per cluster; sorting groups them so each cluster is written once. */
+	qsort(slots, count, sizeof(dir_slot_t), _dir_slot_compare);
+
+	/*
+	New clusters are written whole so their tail reads as ENTRY_END. In existing
+	clusters a run of consecutive slots is written as one span without reading
+	the cluster; scattered holes fall back to a read-modify-write of the cluster.
+	*/
+	directory_entry_t* buffer = malloc(FAT_data.cluster_size);
+	result = buffer ? 0 : -1;
+	for (int i = 0; i < count && result == 0; ) {
+		unsigned int cluster = slots[i].cluster;
+		int first = i;
+		for (; i < count && slots[i].cluster == cluster; i++) {
+			if (_dir_index_insert(index, &contents[i]->meta, cluster, slots[i].index) != 0) result = -1;
+		}
+
+		unsigned int low  = slots[first].index;
+		unsigned int span = slots[i - 1].index - low + 1;
+		int is_new = new_first && cluster >= new_first && cluster < new_first + new_count;
+		if (is_new) {
+			memset(buffer, 0, FAT_data.cluster_size);
+			low  = 0;
+			span = entries_per_cluster;
+		}
+		else if (span != (unsigned int)(i - first)) {
+			if (!DSK_readoff_sectors_into((cluster - 2) * (unsigned short)FAT_data.sectors_per_cluster + FAT_data.first_data_sector, 0, FAT_data.sectors_per_cluster, (unsigned char*)buffer)) {
+				result = -1;
+				break;
+			}
+
+			low  = 0;
+			span = entries_per_cluster;
+		}
+
+		for (int j = first; j < i; j++) memcpy(&buffer[slots[j].index - low], &contents[j]->meta, sizeof(directory_entry_t));
+		if (_directory_slots_write(cluster, low, buffer, span) != 0) result = -1;
+	}
+
+	free(buffer);
+
+	free(slots);
+	free(fresh);
+	if (result != 0) {
+		printf("Function FAT_put_contents: Writing new directory entries failed. Aborting...\n");
+		_dir_index_drop(active_cluster);
+		return -1;
+	}
+
+	char key[DCACHE_PATH_MAX];
+	if (_path_normalize(path, key, sizeof(key)) == 0) {
+		size_t base = strlen(key);
+		for (int i = 0; i < count; i++) {
+			char name[13] = { 0 };
+			_fatname2path(contents[i]->meta.file_name, name);
+			if (base + strlen(name) + 2 > sizeof(key)) break;
+
+			key[base] = 0;
+			if (base) strcat(key, "/");
+			strcat(key, name);
+			_dcache_forget_path(key);
+		}
+	}
+
+	return count;
+}
+
+int FAT_delete_content(const char* path) {
+	_async_quiesce(-1);
+
+	int ci = FAT_open_content(path);
+	Content* fat_content = FAT_get_content_from_table(ci);
+	if (fat_content == NULL) {
+		printf("Function FAT_delete_content: FAT_open_content encountered an error. Aborting...\n");
+		return -1;
+	}
+
+	unsigned int data_cluster = GET_CLUSTER_FROM_ENTRY(fat_content->meta, FAT_data.fat_type);
+	unsigned int prev_cluster = 0;
+	if (fat_content->content_type == CONTENT_TYPE_DIRECTORY) _dir_index_drop(data_cluster);
+	
+	while (data_cluster < END_CLUSTER_32) {
+		prev_cluster = __read_fat(data_cluster);
+		if (_cluster_deallocate(data_cluster) != 0) {
+			printf("[%s %i] _cluster_deallocate encountered an error. Aborting...\n", __FILE__, __LINE__);
+			_remove_content_from_table(ci);
+			return -1;
+		}
 
-	char fileNamePart[256] = { 0 };
-	unsigned short start = 0;
-	unsigned int active_cluster = 0;
+		data_cluster = prev_cluster;
+	}
 
-	if (FAT_data.fat_type == 32) active_cluster = FAT_data.ext_root_cluster;
-	else {
-		printf("Function FAT_open_content: FAT16 and FAT12 are not supported!\n");
-		FAT_unload_content_system(fat_content);
-		return -2;
+	if (_directory_remove(fat_content->parent_cluster, (char*)fat_content->meta.file_name) != 0) {
+		printf("[%s %i] _directory_remove encountered an error. Aborting...\n", __FILE__, __LINE__);
+		_remove_content_from_table(ci);
+		return -1;
 	}
-	
+
+	if (fat_content->content_type == CONTENT_TYPE_DIRECTORY) _dcache_reset();
+	else _dcache_forget_location(fat_content->entry_cluster, fat_content->entry_index);
+
+	_remove_content_from_table(ci);
+	return 0;
+}
+
+void FAT_copy_content(char* source, char* destination) {
+	int ci_source = FAT_open_content(source);
+
+	Content* fat_content = FAT_get_content_from_table(ci_source);
+	Content* dst_content = NULL;
+
 	directory_entry_t content_meta;
-	unsigned int parent = active_cluster;
+	memcpy(&content_meta, &fat_content->meta, sizeof(directory_entry_t));
 
-	for (unsigned int i = 0; i <= strlen(path); i++) {
-	    if (path[i] == PATH_DELIMITER || !path[i]) {
-	        if (i == start) {
-	            start = i + 1;
-	            continue;
-	        }
+	if (fat_content->directory != NULL) dst_content = FAT_create_object(fat_content->directory->name, 1, NULL);
+	else if (fat_content->file != NULL) dst_content = FAT_create_object(fat_content->file->name, 0, fat_content->file->extension);
 
-	        memset(fileNamePart, 0, sizeof(fileNamePart));
-	        memcpy(fileNamePart, path + start, i - start);
+	directory_entry_t dst_meta;		
+	memcpy(&dst_meta, &dst_content->meta, sizeof(directory_entry_t));
 
-	        parent = active_cluster;
-	        int result = _directory_search(fileNamePart, active_cluster, &content_meta, NULL);
-	        if (result == -2) { FAT_unload_content_system(fat_content); return -3; }
-	        if (result == -1) { FAT_unload_content_system(fat_content); return -4; }
+	int ci_destination = FAT_put_content(destination, dst_content);
+	unsigned int data_cluster = GET_CLUSTER_FROM_ENTRY(content_meta, FAT_data.fat_type);
+	unsigned int dst_cluster  = GET_CLUSTER_FROM_ENTRY(dst_meta, FAT_data.fat_type);
 
-	        unsigned int entry_cluster = GET_CLUSTER_FROM_ENTRY(content_meta, FAT_data.fat_type);
-	        if (!path[i]) fat_content->parent_cluster = parent;
-	        active_cluster = entry_cluster;
-	        start = i + 1;
-	    }
+	while (data_cluster < END_CLUSTER_32) {
+		_add_cluster_to_content(ci_destination);
+		dst_cluster = __read_fat(dst_cluster);
+		_copy_cluster2cluster(data_cluster, dst_cluster);
+		data_cluster = __read_fat(data_cluster);
 	}
 
-	memcpy(&fat_content->meta, &content_meta, sizeof(directory_entry_t));
-	if ((content_meta.attributes & FILE_DIRECTORY) != FILE_DIRECTORY) {
-		fat_content->file = _create_file();
-		if (!fat_content->file) {
-			FAT_unload_content_system(fat_content);
-			return -5;
+	_remove_content_from_table(ci_destination);
+	_remove_content_from_table(ci_source);
+}
+
+static int _resolve_directory(const char* path, unsigned int* cluster) {
+	dentry_t dentry;
+	int result = _path_resolve(path, &dentry);
+	if (result != 0) return result;
+	if ((dentry.entry.attributes & FILE_DIRECTORY) != FILE_DIRECTORY) return -3;
+
+	*cluster = GET_CLUSTER_FROM_ENTRY(dentry.entry, FAT_data.fat_type);
+	return 0;
+}
+
+int FAT_directory_open_cluster(unsigned int cluster, DirIter_t* it) {
+	memset(it, 0, sizeof(DirIter_t));
+	if (cluster < 2 || cluster >= END_CLUSTER_32) return -2;
+
+	it->first_cluster = cluster;
+	_lfn_reset(&it->lfn);
+	_dir_window_open(&it->window, cluster);
+	return 0;
+}
+
+/* Returns 0 on success, -3 if path does not exist, -2 if it is not a directory. */
+int FAT_directory_open(const char* path, DirIter_t* it) {
+	unsigned int cluster = 0;
+	int result = _resolve_directory(path, &cluster);
+	if (result == -2) return -3;
+	if (result == -3) return -2;
+	if (result != 0) return -1;
+	return FAT_directory_open_cluster(cluster, it);
+}
+
+/*
+Streams the next live 8.3 entry into the caller's item, with the long name
+assembled from the LFN slots in front of it when their checksum matches.
+Deleted and volume label slots are skipped. The chain is read one window at a time
+into a buffer reused for the whole walk. Returns 1 with an entry, 0 at the
+end, -1 on error.
+*/
+int FAT_directory_next(DirIter_t* it, DirEntry_t* item) {
+	unsigned int entries_per_cluster = FAT_data.cluster_size / sizeof(directory_entry_t);
+	while (1) {
+		if (it->position >= it->window.count * entries_per_cluster) {
+			int loaded = _dir_window_fill(&it->window);
+			if (loaded < 0) {
+				printf("Function FAT_directory_next: reading of the directory chain failed. Aborting...\n");
+				it->window.next = 0;
+				return -1;
+			}
+
+			if (loaded == 0) return 0;
+			it->position = 0;
 		}
 
-		fat_content->content_type = CONTENT_TYPE_FILE;
-		unsigned int* content = NULL;
-		int content_size = 0;
-		
-		int cluster = GET_CLUSTER_FROM_ENTRY(content_meta, FAT_data.fat_type);
-		while (cluster < END_CLUSTER_32) {
-			unsigned int* new_content = (unsigned int*)realloc(content, (content_size + 1) * sizeof(unsigned int));
-			if (new_content == NULL) {
-				free(content);
-				FAT_unload_content_system(fat_content);
-				return -6;
+		directory_entry_t* entries = (directory_entry_t*)it->window.data;
+		while (it->position < it->window.count * entries_per_cluster) {
+			unsigned int i = it->position++;
+			directory_entry_t* entry = &entries[i];
+			if (entry->file_name[0] == ENTRY_END) {
+				it->window.next  = 0;
+				it->window.count = 0;
+				return 0;
 			}
 
-			new_content[content_size] = cluster;
-			content = new_content;
-			content_size++;
+			unsigned int current = it->window.clusters[i / entries_per_cluster];
+			if (entry->file_name[0] == ENTRY_FREE) {
+				_lfn_reset(&it->lfn);
+				continue;
+			}
 
-			cluster = __read_fat(cluster);
-			if (cluster == BAD_CLUSTER_32) {
-				printf("Function FAT_open_content: the cluster chain is corrupted with a bad cluster. Aborting...\n");
-				free(content);
-				FAT_unload_content_system(fat_content);
-				return -7;
+			if ((entry->attributes & FILE_LONG_NAME) == FILE_LONG_NAME) {
+				_lfn_feed(&it->lfn, entry, current, i % entries_per_cluster);
+				continue;
 			}
-			else if (cluster == -1) {
-				printf("Function FAT_open_content: an error occurred in __read_fat. Aborting...\n");
-				free(content);
-				FAT_unload_content_system(fat_content);
-				return -8;
+
+			if (entry->attributes & FILE_VOLUME_ID) {
+				_lfn_reset(&it->lfn);
+				continue;
 			}
+
+			_lfn_take(&it->lfn, entry, item->long_name, sizeof(item->long_name));
+			_lfn_reset(&it->lfn);
+
+			memcpy(&item->entry, entry, sizeof(directory_entry_t));
+			memset(item->name, 0, sizeof(item->name));
+			_fatname2path(entry->file_name, item->name);
+			item->entry_cluster = current;
+			item->entry_index   = i % entries_per_cluster;
+			return 1;
 		}
-		
-		fat_content->file->data = (unsigned int*)malloc(content_size * sizeof(unsigned int));
-		if (!fat_content->file->data) {
-			free(content);
-			free(fat_content->file);
-			FAT_unload_content_system(fat_content);
-			return -9;
+	}
+}
+
+void FAT_directory_close(DirIter_t* it) {
+	_dir_window_close(&it->window);
+	memset(it, 0, sizeof(DirIter_t));
+}
+
+/* Counts clusters and physically contiguous runs of a chain. */
+static int _chain_extents(unsigned int first, unsigned int* clusters, unsigned int* extents) {
+	*clusters = 0;
+	*extents  = 0;
+
+	unsigned int cluster = first;
+	unsigned int prev    = 0;
+	while (cluster >= 2 && cluster < END_CLUSTER_32 && *clusters <= FAT_data.total_clusters) {
+		if (prev == 0 || cluster != prev + 1) (*extents)++;
+		(*clusters)++;
+
+		prev = cluster;
+		int next = __read_fat(cluster);
+		if (next < 0) return -1;
+		cluster = (unsigned int)next;
+	}
+
+	return 0;
+}
+
+typedef int (*_walk_visitor_t)(directory_entry_t* entry, unsigned int entry_cluster, unsigned int entry_index, const char* path, void* ctx);
+
+typedef struct {
+	unsigned int* clusters;
+	unsigned int count;
+	unsigned int capacity;
+} _visited_t;
+
+/* Open-addressed set of directory clusters (0 marks an empty slot); returns 1 if cluster was new. */
+static int _visited_add(_visited_t* visited, unsigned int cluster) {
+	if ((visited->count + 1) * 2 > visited->capacity) {
+		unsigned int capacity = visited->capacity ? visited->capacity * 2 : 64;
+		unsigned int* clusters = calloc(capacity, sizeof(unsigned int));
+		if (!clusters) return -1;
+
+		for (unsigned int i = 0; i < visited->capacity; i++) {
+			unsigned int c = visited->clusters[i];
+			if (!c) continue;
+
+			unsigned int pos = (c * 2654435761u) & (capacity - 1);
+			while (clusters[pos]) pos = (pos + 1) & (capacity - 1);
+			clusters[pos] = c;
+		}
+
+		free(visited->clusters);
+		visited->clusters = clusters;
+		visited->capacity = capacity;
+	}
+
+	unsigned int pos = (cluster * 2654435761u) & (visited->capacity - 1);
+	while (visited->clusters[pos]) {
+		if (visited->clusters[pos] == cluster) return 0;
+		pos = (pos + 1) & (visited->capacity - 1);
+	}
+
+	visited->clusters[pos] = cluster;
+	visited->count++;
+	return 1;
+}
+
+/* Calls the visitor for every file below the directory; each directory cluster is visited once. */
+static int _directory_walk(unsigned int cluster, const char* path, _visited_t* visited, _walk_visitor_t visitor, void* ctx) {
+	int added = _visited_add(visited, cluster);
+	if (added <= 0) return added;
+
+	DirIter_t it;
+	if (FAT_directory_open_cluster(cluster, &it) != 0) return -1;
+
+	DirEntry_t item;
+	int result = 0;
+	while (result >= 0 && (result = FAT_directory_next(&it, &item)) == 1) {
+		if (item.name[0] == '.') continue;
+
+		const char* name = item.long_name[0] ? item.long_name : item.name;
+		size_t path_len = strlen(path);
+		char* entry_path = malloc(path_len + strlen(name) + 2);
+		if (!entry_path) {
+			result = -1;
+			break;
+		}
+
+		if (path_len) sprintf(entry_path, "%s%c%s", path, PATH_DELIMITER, name);
+		else strcpy(entry_path, name);
+
+		if (item.entry.attributes & FILE_DIRECTORY) {
+			result = _directory_walk(GET_CLUSTER_FROM_ENTRY(item.entry, FAT_data.fat_type), entry_path, visited, visitor, ctx);
+		}
+		else {
+			result = visitor(&item.entry, item.entry_cluster, item.entry_index, entry_path, ctx);
+		}
+
+		free(entry_path);
+	}
+
+	FAT_directory_close(&it);
+	return result < 0 ? result : 0;
+}
+
+typedef struct {
+	FragReport_t* report;
+	frag_visitor_t visitor;
+	void* ctx;
+} _frag_ctx_t;
+
+static int _fragmentation_visitor(directory_entry_t* entry, unsigned int entry_cluster, unsigned int entry_index, const char* path, void* ctx) {
+	(void)entry_cluster;
+	(void)entry_index;
+
+	_frag_ctx_t* frag = (_frag_ctx_t*)ctx;
+	unsigned int clusters = 0, extents = 0;
+	if (_chain_extents(GET_CLUSTER_FROM_PENTRY(entry, FAT_data.fat_type), &clusters, &extents) != 0) return -1;
+
+	frag->report->files++;
+	frag->report->clusters += clusters;
+	frag->report->extents  += extents;
+	if (extents > 1) frag->report->fragmented_files++;
+	if (frag->visitor) frag->visitor(path, clusters, extents, frag->ctx);
+	return 0;
+}
+
+int FAT_fragmentation_report(const char* path, FragReport_t* report, frag_visitor_t visitor, void* ctx) {
+	if (!report) return -1;
+	memset(report, 0, sizeof(FragReport_t));
+
+	unsigned int cluster = 0;
+	if (_resolve_directory(path, &cluster) != 0) {
+		printf("Function FAT_fragmentation_report: directory '%s' not found. Aborting...\n", path);
+		return -2;
+	}
+
+	_frag_ctx_t frag = { .report = report, .visitor = visitor, .ctx = ctx };
+	_visited_t visited = { 0 };
+	int result = _directory_walk(cluster, path ? path : "", &visited, _fragmentation_visitor, &frag);
+	free(visited.clusters);
+	if (result < 0) return -1;
+
+	/* Share of cluster boundaries inside files that are breaks: 0 is fully contiguous, 1 is one extent per cluster. */
+	unsigned int data_files = report->files;
+	unsigned int boundaries = (report->clusters > data_files) ? report->clusters - data_files : 0;
+	unsigned int breaks = (report->extents > data_files) ? report->extents - data_files : 0;
+	report->score = boundaries ? (double)breaks / (double)boundaries : 0.0;
+	return 0;
+}
+
+static void _content_table_relocate(unsigned int old_first, unsigned int new_first, unsigned int count) {
+	pthread_mutex_lock(&_content_table_lock);
+	for (int i = 0; i < CONTENT_TABLE_SIZE; i++) {
+		Content* c = _content_table[i];
+		if (!c || c->content_type != CONTENT_TYPE_FILE || !c->file) continue;
+		if ((unsigned int)GET_CLUSTER_FROM_ENTRY(c->meta, FAT_data.fat_type) != old_first) continue;
+
+		unsigned int* data = realloc(c->file->data, count * sizeof(unsigned int));
+		if (!data) continue;
+
+		for (unsigned int k = 0; k < count; k++) data[k] = new_first + k;
+		c->file->data      = data;
+		c->file->data_size = (int)count;
+		c->meta.low_bits   = GET_ENTRY_LOW_BITS(new_first, FAT_data.fat_type);
+		c->meta.high_bits  = GET_ENTRY_HIGH_BITS(new_first, FAT_data.fat_type);
+	}
+	pthread_mutex_unlock(&_content_table_lock);
+}
+
+/*
+Moves a fragmented chain into one free run: the new chain is fully linked and
+copied before the directory entry is switched to it, and the old chain is
+freed only after that single entry update.
+Returns 1 if the file was moved, 0 if it was already contiguous or no run fits.
+*/
+static int _defragment_entry(directory_entry_t* entry, unsigned int entry_cluster, unsigned int entry_index) {
+	unsigned int old_first = GET_CLUSTER_FROM_PENTRY(entry, FAT_data.fat_type);
+	unsigned int clusters = 0, extents = 0;
+	if (_chain_extents(old_first, &clusters, &extents) != 0) return -1;
+	if (extents <= 1) return 0;
+
+	unsigned int new_first = 0;
+	int found = _cluster_find_free_run(clusters, 2, &new_first);
+	if (found == -2) return 0;
+	_fat_batch_begin();
+	int claimed = (found == 0) ? _cluster_claim_run(new_first, clusters) : -1;
+	if (_fat_batch_end() != 0 || claimed != 0) return -1;
+
+	unsigned int source = old_first;
+	for (unsigned int i = 0; i < clusters; i++) {
+		if (_copy_cluster2cluster(source, new_first + i) != 1) {
+			printf("Function _defragment_entry: _copy_cluster2cluster encountered an error. Aborting...\n");
+			_chain_free(new_first);
+			return -1;
+		}
+
+		int next = __read_fat(source);
+		if (next < 0) {
+			_chain_free(new_first);
+			return -1;
+		}
+
+		source = (unsigned int)next;
+	}
+
+	entry->low_bits  = GET_ENTRY_LOW_BITS(new_first, FAT_data.fat_type);
+	entry->high_bits = GET_ENTRY_HIGH_BITS(new_first, FAT_data.fat_type);
+	if (_directory_entry_write(entry_cluster, entry_index, entry) != 0) {
+		printf("Function _defragment_entry: relinking directory entry failed. Aborting...\n");
+		_chain_free(new_first);
+		return -1;
+	}
+
+	_chain_free(old_first);
+	_content_table_relocate(old_first, new_first, clusters);
+	return 1;
+}
+
+int FAT_defragment_content(const char* path) {
+	_async_quiesce(-1);
+
+	dentry_t dentry;
+	if (_path_resolve(path, &dentry) != 0 || dentry.entry_cluster == 0) return -2;
+	if (dentry.entry.attributes & FILE_DIRECTORY) return -3;
+
+	return _defragment_entry(&dentry.entry, dentry.entry_cluster, dentry.entry_index);
+}
+
+static int _defragment_visitor(directory_entry_t* entry, unsigned int entry_cluster, unsigned int entry_index, const char* path, void* ctx) {
+	(void)path;
+	int result = _defragment_entry(entry, entry_cluster, entry_index);
+	if (result > 0) (*(int*)ctx)++;
+	return (result < 0) ? result : 0;
+}
+
+int FAT_defragment(const char* path) {
+	_async_quiesce(-1);
+
+	unsigned int cluster = 0;
+	if (_resolve_directory(path, &cluster) != 0) {
+		printf("Function FAT_defragment: directory '%s' not found. Aborting...\n", path);
+		return -2;
+	}
+
+	int moved = 0;
+	_visited_t visited = { 0 };
+	int result = _directory_walk(cluster, path ? path : "", &visited, _defragment_visitor, &moved);
+	free(visited.clusters);
+	return (result < 0) ? result : moved;
+}
+
+/* Points open handles whose entry moved during compaction at the new slot. */
+static void _content_table_move_entries(unsigned int parent, const unsigned int* chain, unsigned int chain_len, const int* moved) {
+	unsigned int entries_per_cluster = FAT_data.cluster_size / sizeof(directory_entry_t);
+	pthread_mutex_lock(&_content_table_lock);
+	for (int i = 0; i < CONTENT_TABLE_SIZE; i++) {
+		Content* c = _content_table[i];
+		if (!c || c->parent_cluster != parent) continue;
+
+		for (unsigned int k = 0; k < chain_len; k++) {
+			if (chain[k] != c->entry_cluster) continue;
+
+			int to = moved[k * entries_per_cluster + c->entry_index];
+			if (to >= 0) {
+				c->entry_cluster = chain[to / entries_per_cluster];
+				c->entry_index   = (unsigned int)to % entries_per_cluster;
+			}
+
+			break;
+		}
+	}
+	pthread_mutex_unlock(&_content_table_lock);
+}
+
+/*
+Packs the live entries of a directory to the front of its chain, keeping
+each LFN sequence in front of its entry, and frees the clusters left empty.
+Deleted slots and orphaned LFN slots are dropped. Only clusters whose
+contents change are rewritten; the chain is cut only after the data is
+in place. Returns the number of clusters freed.
+*/
+int FAT_directory_compact(const char* path) {
+	unsigned int cluster = 0;
+	if (_resolve_directory(path, &cluster) != 0) {
+		printf("Function FAT_directory_compact: directory '%s' not found. Aborting...\n", path);
+		return -2;
+	}
+
+	unsigned int entries_per_cluster = FAT_data.cluster_size / sizeof(directory_entry_t);
+	unsigned int* chain = NULL;
+	unsigned char* data = NULL;
+	unsigned int chain_len = 0, chain_cap = 0;
+
+	dir_window_t window;
+	_dir_window_open(&window, cluster);
+
+	int loaded = 0, result = 0;
+	while ((loaded = _dir_window_fill(&window)) > 0) {
+		if (chain_len + (unsigned int)loaded > chain_cap) {
+			unsigned int capacity = MAX(chain_cap * 2, chain_len + (unsigned int)loaded);
+			unsigned int* clusters = realloc(chain, capacity * sizeof(unsigned int));
+			if (clusters) chain = clusters;
+			unsigned char* bytes = clusters ? realloc(data, (size_t)capacity * FAT_data.cluster_size) : NULL;
+			if (bytes) data = bytes;
+			if (!clusters || !bytes) {
+				result = -1;
+				break;
+			}
+
+			chain_cap = capacity;
+		}
+
+		memcpy(chain + chain_len, window.clusters, loaded * sizeof(unsigned int));
+		memcpy(data + (size_t)chain_len * FAT_data.cluster_size, window.data, (size_t)loaded * FAT_data.cluster_size);
+		chain_len += (unsigned int)loaded;
+	}
+
+	_dir_window_close(&window);
+	if (loaded < 0 || result != 0 || chain_len == 0) {
+		printf("Function FAT_directory_compact: reading of the directory chain failed. Aborting...\n");
+		free(chain);
+		free(data);
+		return -1;
+	}
+
+	unsigned int total = chain_len * entries_per_cluster;
+	directory_entry_t* entries = (directory_entry_t*)data;
+	directory_entry_t* packed  = calloc(total, sizeof(directory_entry_t));
+	int* moved = malloc(total * sizeof(int));
+	if (!packed || !moved) {
+		free(chain);
+		free(data);
+		free(packed);
+		free(moved);
+		return -1;
+	}
+
+	/*
+	LFN slots are held back until the entry they belong to shows up, and only
+	kept when they form a whole sequence whose checksum matches that entry.
+	*/
+	lfn_state_t lfn;
+	_lfn_reset(&lfn);
+
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < total; i++) {
+		moved[i] = -1;
+		if (entries[i].file_name[0] == ENTRY_END) {
+			for (unsigned int j = i + 1; j < total; j++) moved[j] = -1;
+			break;
+		}
+
+		if (entries[i].file_name[0] == ENTRY_FREE) {
+			_lfn_reset(&lfn);
+			continue;
+		}
+
+		if ((entries[i].attributes & FILE_LONG_NAME) == FILE_LONG_NAME) {
+			_lfn_feed(&lfn, &entries[i], 0, i);
+			continue;
+		}
+
+		if (lfn.count && lfn.next == 0 && lfn.checksum == _lfn_checksum(entries[i].file_name)) {
+			for (unsigned int k = 0; k < lfn.count; k++) memcpy(&packed[count++], &entries[lfn.first_index + k], sizeof(directory_entry_t));
+		}
+
+		_lfn_reset(&lfn);
+
+		moved[i] = (int)count;
+		memcpy(&packed[count++], &entries[i], sizeof(directory_entry_t));
+	}
+
+	unsigned int keep = MAX(1u, (count + entries_per_cluster - 1) / entries_per_cluster);
+	size_t cluster_size = FAT_data.cluster_size;
+	for (unsigned int k = 0; k < keep && result == 0; k++) {
+		if (memcmp(data + k * cluster_size, (unsigned char*)packed + k * cluster_size, cluster_size) == 0) continue;
+		if (_cluster_write((unsigned char*)packed + k * cluster_size, chain[k]) != 0) result = -1;
+	}
+
+	int freed = 0;
+	if (result == 0 && keep < chain_len) {
+		_fat_batch_begin();
+		result = _set_cluster_end(chain[keep - 1], FAT_data.fat_type);
+		for (unsigned int k = keep; k < chain_len && result == 0; k++) {
+			if (_cluster_deallocate(chain[k]) != 0) result = -1;
+			else freed++;
+		}
+
+		if (_fat_batch_end() != 0) result = -1;
+	}
+
+	/* Every slot may have moved, so cached locations of this directory go. */
+	_content_table_move_entries(cluster, chain, chain_len, moved);
+	_dir_index_drop(cluster);
+	_dcache_reset();
+
+	free(chain);
+	free(data);
+	free(packed);
+	free(moved);
+	if (result != 0) {
+		printf("Function FAT_directory_compact: Writing the packed directory failed. Aborting...\n");
+		return -1;
+	}
+
+	return freed;
+}
+
+/*
+Parallel tree walk. Every worker owns a deque of directories still to read:
+it pushes and pops subdirectories at the tail, idle workers steal from the
+head, where the oldest and usually largest subtrees sit. Each worker reads
+its directories through its own iterator, so cluster reads overlap.
+*/
+typedef struct {
+	unsigned int cluster;
+	char* path;
+} _walk_job_t;
+
+typedef struct {
+	pthread_mutex_t lock;
+	_walk_job_t* jobs;
+	unsigned int head;
+	unsigned int count;
+	unsigned int capacity;
+} _walk_deque_t;
+
+typedef struct {
+	walk_visitor_t visitor;
+	void* ctx;
+	unsigned int workers;
+	_walk_deque_t deques[WALK_MAX_THREADS];
+	atomic_uint queued;     // jobs sitting in deques
+	atomic_uint pending;    // jobs queued or being read
+	atomic_uint idle;
+	atomic_int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_mutex_t visited_lock;
+	_visited_t visited;
+} _walk_pool_t;
+
+typedef struct {
+	_walk_pool_t* pool;
+	unsigned int id;
+} _walk_worker_t;
+
+static int _walk_deque_push(_walk_deque_t* deque, const _walk_job_t* job) {
+	pthread_mutex_lock(&deque->lock);
+	if (deque->count == deque->capacity) {
+		unsigned int capacity = deque->capacity ? deque->capacity * 2 : 64;
+		_walk_job_t* jobs = malloc(capacity * sizeof(_walk_job_t));
+		if (!jobs) {
+			pthread_mutex_unlock(&deque->lock);
+			return -1;
+		}
+
+		for (unsigned int i = 0; i < deque->count; i++) jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+		free(deque->jobs);
+		deque->jobs     = jobs;
+		deque->head     = 0;
+		deque->capacity = capacity;
+	}
+
+	deque->jobs[(deque->head + deque->count) % deque->capacity] = *job;
+	deque->count++;
+	pthread_mutex_unlock(&deque->lock);
+	return 0;
+}
+
+static int _walk_deque_take(_walk_deque_t* deque, _walk_job_t* job, int steal) {
+	pthread_mutex_lock(&deque->lock);
+	int taken = deque->count > 0;
+	if (taken && steal) {
+		*job = deque->jobs[deque->head];
+		deque->head = (deque->head + 1) % deque->capacity;
+		deque->count--;
+	}
+	else if (taken) {
+		deque->count--;
+		*job = deque->jobs[(deque->head + deque->count) % deque->capacity];
+	}
+
+	pthread_mutex_unlock(&deque->lock);
+	return taken;
+}
+
+static int _walk_submit(_walk_pool_t* pool, unsigned int worker, unsigned int cluster, char* path) {
+	_walk_job_t job = { .cluster = cluster, .path = path };
+	atomic_fetch_add(&pool->pending, 1);
+	if (_walk_deque_push(&pool->deques[worker], &job) != 0) {
+		atomic_fetch_sub(&pool->pending, 1);
+		return -1;
+	}
+
+	atomic_fetch_add(&pool->queued, 1);
+	if (atomic_load(&pool->idle)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->wake);
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	return 0;
+}
+
+/* Reads one directory: visits its entries and queues its subdirectories. */
+static int _walk_directory(_walk_pool_t* pool, unsigned int worker, const _walk_job_t* job) {
+	DirIter_t it;
+	if (FAT_directory_open_cluster(job->cluster, &it) != 0) return -1;
+
+	DirEntry_t item;
+	int result = 0;
+	while (!atomic_load(&pool->failed) && (result = FAT_directory_next(&it, &item)) == 1) {
+		if (item.name[0] == '.') continue;
+
+		const char* name = item.long_name[0] ? item.long_name : item.name;
+		size_t path_len = strlen(job->path);
+		char* entry_path = malloc(path_len + strlen(name) + 2);
+		if (!entry_path) {
+			result = -1;
+			break;
 		}
 
-		memcpy(fat_content->file->data, content, content_size * sizeof(unsigned int));
-		fat_content->file->data_size = content_size;
-		free(content);
+		if (path_len) sprintf(entry_path, "%s%c%s", job->path, PATH_DELIMITER, name);
+		else strcpy(entry_path, name);
 
-		char full[13] = {0};
-		_fatname2name((char*)fat_content->meta.file_name, full);   // например "TEST_1.TXT" или "ASD"
+		int verdict = pool->visitor ? pool->visitor(entry_path, &item, pool->ctx) : 0;
+		if (verdict < 0) {
+			free(entry_path);
+			result = verdict;
+			break;
+		}
 
-		fat_content->file->name[0] = 0;
-		fat_content->file->extension[0] = 0;
+		if ((item.entry.attributes & FILE_DIRECTORY) && verdict == 0) {
+			unsigned int child = GET_CLUSTER_FROM_ENTRY(item.entry, FAT_data.fat_type);
+			pthread_mutex_lock(&pool->visited_lock);
+			int added = (child >= 2 && child < END_CLUSTER_32) ? _visited_add(&pool->visited, child) : 0;
+			pthread_mutex_unlock(&pool->visited_lock);
 
-		char* dot = strchr(full, '.');
-		if (dot) {
-		    *dot = 0;
-		
-		    strncpy(fat_content->file->name, full, sizeof(fat_content->file->name) - 1);
-		    fat_content->file->name[sizeof(fat_content->file->name) - 1] = 0;
-		
-		    strncpy(fat_content->file->extension, dot + 1, sizeof(fat_content->file->extension) - 1);
-		    fat_content->file->extension[sizeof(fat_content->file->extension) - 1] = 0;
-		} 
-		else {
-		    strncpy(fat_content->file->name, full, sizeof(fat_content->file->name) - 1);
-		    fat_content->file->name[sizeof(fat_content->file->name) - 1] = 0;
-		    fat_content->file->extension[0] = 0;
+			if (added < 0 || (added > 0 && _walk_submit(pool, worker, child, entry_path) != 0)) {
+				free(entry_path);
+				result = -1;
+				break;
+			}
+
+			if (added > 0) entry_path = NULL;
 		}
+
+		free(entry_path);
 	}
-	else {
-		fat_content->directory = _create_directory();
-		if (!fat_content->directory) {
-			FAT_unload_content_system(fat_content);
-			return -10;
+
+	FAT_directory_close(&it);
+	return result < 0 ? result : 0;
+}
+
+/* Own deque first, then the other workers' in turn; blocks until work shows up or the walk is over. */
+static int _walk_next(_walk_pool_t* pool, unsigned int worker, _walk_job_t* job) {
+	while (1) {
+		if (_walk_deque_take(&pool->deques[worker], job, 0)) return 1;
+		for (unsigned int i = 1; i < pool->workers; i++) {
+			if (_walk_deque_take(&pool->deques[(worker + i) % pool->workers], job, 1)) return 1;
 		}
 
-		fat_content->content_type = CONTENT_TYPE_DIRECTORY;
-		char dname[13] = {0};
-		_fatname2name((char*)content_meta.file_name, dname);
-		char* dot = strchr(dname, '.');
-		if (dot) *dot = 0;
-			
-		strncpy(fat_content->directory->name, dname, sizeof(fat_content->directory->name) - 1);
-		fat_content->directory->name[sizeof(fat_content->directory->name) - 1] = 0;
+		pthread_mutex_lock(&pool->lock);
+		atomic_fetch_add(&pool->idle, 1);
+		while (!atomic_load(&pool->queued) && atomic_load(&pool->pending)) pthread_cond_wait(&pool->wake, &pool->lock);
+		atomic_fetch_sub(&pool->idle, 1);
+		int finished = !atomic_load(&pool->pending);
+		pthread_mutex_unlock(&pool->lock);
+		if (finished) return 0;
 	}
+}
 
-	int ci = _add_content2table(fat_content);
-	if (ci < 0) {
-		printf("Function FAT_open_content: an error occurred in _add_content2table. Aborting...\n");
-		if (fat_content->file) free(fat_content->file);
-		else if (fat_content->directory) free(fat_content->directory);
-		FAT_unload_content_system(fat_content);
-		return -11;
+static void* _walk_worker(void* arg) {
+	_walk_worker_t* self = (_walk_worker_t*)arg;
+	_walk_pool_t* pool = self->pool;
+
+	_walk_job_t job;
+	while (_walk_next(pool, self->id, &job)) {
+		atomic_fetch_sub(&pool->queued, 1);
+		if (!atomic_load(&pool->failed)) {
+			int result = _walk_directory(pool, self->id, &job);
+			if (result < 0) atomic_store(&pool->failed, result);
+		}
+
+		free(job.path);
+		if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+			pthread_mutex_lock(&pool->lock);
+			pthread_cond_broadcast(&pool->wake);
+			pthread_mutex_unlock(&pool->lock);
+		}
 	}
 
-	return ci;
+	return NULL;
 }
 
-Content* FAT_get_content_from_table(int ci) {
-	return _content_table[ci];
+static int _walk_cluster(unsigned int cluster, const char* path, int threads, walk_visitor_t visitor, void* ctx) {
+	if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0) threads = 1;
+	if (threads > WALK_MAX_THREADS) threads = WALK_MAX_THREADS;
+
+	_walk_pool_t* pool = calloc(1, sizeof(_walk_pool_t));
+	if (!pool) return -1;
+
+	pool->visitor = visitor;
+	pool->ctx     = ctx;
+	pool->workers = (unsigned int)threads;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_mutex_init(&pool->visited_lock, NULL);
+	for (unsigned int i = 0; i < pool->workers; i++) pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+	char* root_path = strdup(path ? path : "");
+	int result = (root_path && _visited_add(&pool->visited, cluster) >= 0) ? _walk_submit(pool, 0, cluster, root_path) : -1;
+	if (result != 0) free(root_path);
+
+	/* The calling thread is worker 0. */
+	_walk_worker_t workers[WALK_MAX_THREADS];
+	pthread_t handles[WALK_MAX_THREADS];
+	unsigned int started = 1;
+	for (unsigned int i = 0; i < pool->workers; i++) workers[i] = (_walk_worker_t){ .pool = pool, .id = i };
+	for (; result == 0 && started < pool->workers; started++) {
+		if (pthread_create(&handles[started], NULL, _walk_worker, &workers[started]) != 0) break;
+	}
+
+	if (result == 0) _walk_worker(&workers[0]);
+	for (unsigned int i = 1; i < started; i++) pthread_join(handles[i], NULL);
+	if (result == 0) result = atomic_load(&pool->failed);
+
+	for (unsigned int i = 0; i < pool->workers; i++) {
+		free(pool->deques[i].jobs);
+		pthread_mutex_destroy(&pool->deques[i].lock);
+	}
+
+	free(pool->visited.clusters);
+	pthread_mutex_destroy(&pool->visited_lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+	return result;
 }
 
-int FAT_close_content(int ci) {
-	return _remove_content_from_table(ci);
+int FAT_walk(const char* path, int threads, walk_visitor_t visitor, void* ctx) {
+	unsigned int cluster = 0;
+	if (_resolve_directory(path, &cluster) != 0) {
+		printf("Function FAT_walk: directory '%s' not found. Aborting...\n", path);
+		return -2;
+	}
+
+	return _walk_cluster(cluster, path, threads, visitor, ctx) < 0 ? -1 : 0;
 }
 
-int FAT_read_content2buffer(int ci, unsigned char* buffer, unsigned int offset, unsigned int size) {
-    Content* c = FAT_get_content_from_table(ci);
-    if (!c || !c->file) return -1;
+typedef struct {
+	atomic_ullong files;
+	atomic_ullong directories;
+	atomic_ullong bytes;
+	atomic_ullong clusters;
+} _du_ctx_t;
 
-    unsigned int file_size = c->meta.file_size;
-    if (offset >= file_size) return 0;
+static int _du_visitor(const char* path, const DirEntry_t* item, void* ctx) {
+	(void)path;
 
-    unsigned int to_read = size;
-    if (to_read > file_size - offset) to_read = file_size - offset;
+	_du_ctx_t* du = (_du_ctx_t*)ctx;
+	unsigned int clusters = 0, extents = 0;
+	if (_chain_extents(GET_CLUSTER_FROM_ENTRY(item->entry, FAT_data.fat_type), &clusters, &extents) != 0) return -1;
 
-    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+	atomic_fetch_add(&du->clusters, clusters);
+	if (item->entry.attributes & FILE_DIRECTORY) {
+		atomic_fetch_add(&du->directories, 1);
+	}
+	else {
+		atomic_fetch_add(&du->files, 1);
+		atomic_fetch_add(&du->bytes, item->entry.file_size);
+	}
 
-    unsigned int cluster_seek   = offset / cluster_bytes;
-    unsigned int in_cluster_off = offset % cluster_bytes;
+	return 0;
+}
 
-    unsigned int pos = 0;
-    while (pos < to_read && cluster_seek < (unsigned int)c->file->data_size) {
-        unsigned int chunk = to_read - pos;
-        unsigned int max_in_cluster = cluster_bytes - in_cluster_off;
-        if (chunk > max_in_cluster) chunk = max_in_cluster;
-        if (_cluster_read_range(c->file->data[cluster_seek], in_cluster_off, buffer + pos, chunk) != 0) {
-            return (int)pos;
-        }
+int FAT_du(const char* path, int threads, DuReport_t* report) {
+	if (!report) return -1;
+	memset(report, 0, sizeof(DuReport_t));
 
-        pos += chunk;
-        cluster_seek++;
-        in_cluster_off = 0;
-    }
+	_du_ctx_t du;
+	atomic_init(&du.files, 0);
+	atomic_init(&du.directories, 0);
+	atomic_init(&du.bytes, 0);
+	atomic_init(&du.clusters, 0);
 
-    return (int)pos;
+	int result = FAT_walk(path, threads, _du_visitor, &du);
+	if (result != 0) return result;
+
+	report->files       = atomic_load(&du.files);
+	report->directories = atomic_load(&du.directories);
+	report->bytes       = atomic_load(&du.bytes);
+	report->clusters    = atomic_load(&du.clusters);
+	report->allocated   = report->clusters * FAT_data.cluster_size;
+	return 0;
 }
 
-int FAT_write_buffer2content(int ci, const unsigned char* buffer, unsigned int offset, unsigned int size) {
-    Content* c = FAT_get_content_from_table(ci);
-    if (!c || !c->file) return -1;
+/* Case-insensitive glob match: '*' takes any run of characters, '?' exactly one byte. */
+static int _glob_match(const char* pattern, const char* name) {
+	const char* star = NULL;
+	const char* resume = NULL;
+	while (*name) {
+		if (*pattern == '*') {
+			star   = pattern++;
+			resume = name;
+		}
+		else if (*pattern == '?' || (*pattern && toupper((unsigned char)*pattern) == toupper((unsigned char)*name))) {
+			pattern++;
+			name++;
+		}
+		else if (star) {
+			pattern = star + 1;
+			name    = ++resume;
+		}
+		else {
+			return 0;
+		}
+	}
 
-    unsigned int cluster_bytes = FAT_data.sectors_per_cluster * SECTOR_SIZE;
+	while (*pattern == '*') pattern++;
+	return *pattern == 0;
+}
 
-    unsigned int cluster_seek   = offset / cluster_bytes;
-    unsigned int in_cluster_off = offset % cluster_bytes;
+typedef struct {
+	const char* pattern;
+	find_visitor_t visitor;
+	void* ctx;
+	atomic_uint matches;
+} _find_ctx_t;
 
-    while ((unsigned int)c->file->data_size <= cluster_seek) {
-        _add_cluster_to_content(ci);
-        if ((unsigned int)c->file->data_size <= cluster_seek) return -2;
-    }
+static int _find_visitor(const char* path, const DirEntry_t* item, void* ctx) {
+	_find_ctx_t* find = (_find_ctx_t*)ctx;
+	int matched = _glob_match(find->pattern, item->name) || (item->long_name[0] && _glob_match(find->pattern, item->long_name));
+	if (!matched) return 0;
 
-    unsigned int pos = 0;
-    unsigned int idx = cluster_seek;
+	atomic_fetch_add(&find->matches, 1);
+	if (find->visitor) find->visitor(path, item, find->ctx);
+	return 0;
+}
 
-    while (pos < size) {
-        if (idx >= (unsigned int)c->file->data_size) {
-            _add_cluster_to_content(ci);
-            if (idx >= (unsigned int)c->file->data_size) return (int)pos;
-        }
+int FAT_find(const char* path, const char* pattern, int threads, find_visitor_t visitor, void* ctx) {
+	if (!pattern) return -1;
 
-        unsigned int chunk = size - pos;
-        unsigned int max_in_cluster = cluster_bytes - in_cluster_off;
-        if (chunk > max_in_cluster) chunk = max_in_cluster;
+	_find_ctx_t find = { .pattern = pattern, .visitor = visitor, .ctx = ctx };
+	atomic_init(&find.matches, 0);
 
-        if (_cluster_writeoff(buffer + pos, c->file->data[idx], in_cluster_off, chunk) != 0) {
-            return (int)pos;
-        }
+	int result = FAT_walk(path, threads, _find_visitor, &find);
+	return (result != 0) ? result : (int)atomic_load(&find.matches);
+}
 
-        pos += chunk;
-        idx++;
-        in_cluster_off = 0;
-    }
+/*
+Mount sidecar. At unmount the derived state that is expensive to rebuild,
+the allocation group summaries and the directory indexes, is written to a
+file next to the image. At mount it is used only if it names the same
+volume, the FAT and every indexed directory hash to the values recorded
+with it, and the volume was marked clean, which no mount does until it
+unmounts. The directory hashes catch entries rewritten in place, such as a
+new file size or name, which leave the FAT as it was.
+*/
+#define SIDECAR_MAGIC   0x52435346u   /* "FSCR" */
+#define SIDECAR_VERSION 2u
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t volume_id;
+	uint32_t total_clusters;
+	uint32_t cluster_size;
+	uint32_t group_count;
+	uint32_t group_size;
+	uint32_t index_count;
+	uint64_t fat_hash;
+} _sidecar_header_t;
+
+typedef struct {
+	unsigned char* data;
+	size_t size;
+	size_t capacity;
+	int failed;
+} _sidecar_buf_t;
+
+static char* _sidecar_path = NULL;
+static int _sidecar_loaded = 0;
+
+static uint64_t _sidecar_hash(uint64_t hash, const unsigned char* data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+	}
 
-    unsigned int end_pos = offset + size;
-    if (end_pos > c->meta.file_size) c->meta.file_size = end_pos;
+	return hash;
+}
+
+/* Hashes the first FAT copy as it is on disk. */
+static int _sidecar_fat_hash(uint64_t* hash) {
+	unsigned int chunk = 256;
+	unsigned char* buffer = malloc((size_t)chunk * FAT_data.bytes_per_sector);
+	if (!buffer) return -1;
+
+	*hash = 14695981039346656037ull;
+	for (unsigned int at = 0; at < FAT_data.fat_size; at += chunk) {
+		unsigned int count = MIN(chunk, FAT_data.fat_size - at);
+		if (!DSK_read_sectors_into(FAT_data.first_fat_sector + at, count, buffer)) {
+			free(buffer);
+			return -1;
+		}
+
+		*hash = _sidecar_hash(*hash, buffer, (size_t)count * FAT_data.bytes_per_sector);
+	}
 
-    return 1;
+	free(buffer);
+	return 0;
 }
 
-int FAT_change_meta(const char* path, const char* new_name) {
-	char fileNamePart[256] = { 0 };
-	unsigned short start = 0;
-	unsigned int active_cluster = 0;
-	unsigned int prev_active_cluster = 0;
+/* Hashes a directory's clusters as they are on disk. */
+static int _sidecar_dir_hash(unsigned int cluster, uint64_t* hash) {
+	dir_window_t window;
+	_dir_window_open(&window, cluster);
 
-	if (FAT_data.fat_type == 32) active_cluster = FAT_data.ext_root_cluster;
-	else {
-		printf("Function FAT_change_meta: FAT16 and FAT12 are not supported!\n");
-		return -1;
+	int loaded = 0;
+	*hash = 14695981039346656037ull;
+	while ((loaded = _dir_window_fill(&window)) > 0) {
+		*hash = _sidecar_hash(*hash, window.data, (size_t)loaded * FAT_data.cluster_size);
 	}
 
-	directory_entry_t file_info;
-	if (strlen(path) == 0) {
-		if (FAT_data.fat_type == 32) {
-			active_cluster 		 = FAT_data.ext_root_cluster;
-			file_info.attributes = FILE_DIRECTORY | FILE_VOLUME_ID;
-			file_info.file_size  = 0;
-			file_info.high_bits  = GET_ENTRY_HIGH_BITS(active_cluster, FAT_data.fat_type);
-			file_info.low_bits 	 = GET_ENTRY_LOW_BITS(active_cluster, FAT_data.fat_type);
-		}
-		else {
-			printf("Function FAT_change_meta: FAT16 and FAT12 are not supported!\n");
-			return -1;
+	_dir_window_close(&window);
+	return (loaded < 0) ? -1 : 0;
+}
+
+static void _sidecar_put(_sidecar_buf_t* buf, const void* data, size_t size) {
+	if (buf->failed || !size) return;
+	if (buf->size + size > buf->capacity) {
+		size_t capacity = MAX(buf->capacity * 2, buf->size + size + 4096);
+		unsigned char* grown = realloc(buf->data, capacity);
+		if (!grown) {
+			buf->failed = 1;
+			return;
 		}
-	}
-	else {
-		for (unsigned int iterator = 0; iterator <= strlen(path); iterator++) 
-			if (path[iterator] == PATH_DELIMITER || !path[iterator]) {
-				prev_active_cluster = active_cluster;
-
-				memset(fileNamePart, 0, 256);
-				memcpy(fileNamePart, path + start, iterator - start);
-
-				int retVal = _directory_search(fileNamePart, active_cluster, &file_info, NULL);
-				switch (retVal) {
-					case -2:
-						printf("Function FAT_change_meta: No matching directory found. Aborting...\n");
-						return -2;
-
-					case -1:
-						printf("Function FAT_change_meta: An error occurred in _directory_search. Aborting...\n");
-						return retVal;
-				}
 
-				start = iterator + 1;
-				active_cluster = GET_CLUSTER_FROM_ENTRY(file_info, FAT_data.fat_type);
-			}
+		buf->data     = grown;
+		buf->capacity = capacity;
 	}
 
-	if (_directory_edit(prev_active_cluster, &file_info, new_name) != 0) {
-		printf("Function FAT_change_meta: _directory_edit encountered an error. Aborting...\n");
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+static int _sidecar_get(_sidecar_buf_t* buf, void* data, size_t size) {
+	if (!size) return 0;
+	if (buf->failed || buf->size + size > buf->capacity) {
+		buf->failed = 1;
 		return -1;
 	}
-	
+
+	memcpy(data, buf->data + buf->size, size);
+	buf->size += size;
 	return 0;
 }
 
-int FAT_put_content(const char* path, Content* content) {
-    int parent_ci = FAT_open_content(path);
-    if (parent_ci < 0) return parent_ci;
+static void _sidecar_put_u32(_sidecar_buf_t* buf, uint32_t value) {
+	_sidecar_put(buf, &value, sizeof(value));
+}
 
-    Content* parent = FAT_get_content_from_table(parent_ci);
-    if (!parent) {
-        FAT_close_content(parent_ci);
-        return -1;
-    }
+static uint32_t _sidecar_get_u32(_sidecar_buf_t* buf) {
+	uint32_t value = 0;
+	_sidecar_get(buf, &value, sizeof(value));
+	return value;
+}
 
-	if (parent->content_type != CONTENT_TYPE_DIRECTORY) {
-		fprintf(stderr, "parent->content_type == %i!\n", parent->content_type);
-        FAT_close_content(parent_ci);
-        return -2;
-    }
+static int _sidecar_save() {
+	_sidecar_header_t header = {
+		.magic = SIDECAR_MAGIC, .version = SIDECAR_VERSION, .volume_id = FAT_data.volume_id,
+		.total_clusters = FAT_data.total_clusters, .cluster_size = FAT_data.cluster_size,
+		.group_count = _alloc_group_count, .group_size = _alloc_group_size
+	};
 
-    directory_entry_t file_info = parent->meta;
-    unsigned int active_cluster = GET_CLUSTER_FROM_ENTRY(file_info, FAT_data.fat_type);
+	for (int i = 0; i < DIR_INDEX_MAX; i++) {
+		if (_dir_indexes[i].cluster) header.index_count++;
+	}
 
-    FAT_close_content(parent_ci);
+	if (_sidecar_fat_hash(&header.fat_hash) != 0) return -1;
 
-    char output[13] = {0};
-    _fatname2name((char*)content->meta.file_name, output);
-    int retVal = _directory_search(output, active_cluster, NULL, NULL);
-    if (retVal == -1) {
-        printf("Function FAT_put_content: _directory_search error. Aborting...\n");
-        return -1;
-    } 
-	else if (retVal != -2) {
-        printf("Function FAT_put_content: file='%s' already exists. Aborting...\n", path);
-        return -3;
-    }
+	_sidecar_buf_t buf = { 0 };
+	_sidecar_put(&buf, &header, sizeof(header));
+	for (unsigned int g = 0; g < _alloc_group_count; g++) {
+		_sidecar_put_u32(&buf, _alloc_groups[g].cursor);
+		_sidecar_put_u32(&buf, (uint32_t)_alloc_groups[g].free_count);
+	}
 
-    if (_directory_add(active_cluster, &content->meta) != 0) {
-        printf("Function FAT_put_content: _directory_add error. Aborting...\n");
-        return -1;
-    }
+	for (int i = 0; i < DIR_INDEX_MAX; i++) {
+		dir_index_t* index = &_dir_indexes[i];
+		if (!index->cluster) continue;
+
+		uint64_t dir_hash = 0;
+		if (_sidecar_dir_hash(index->cluster, &dir_hash) != 0) buf.failed = 1;
+
+		_sidecar_put_u32(&buf, index->cluster);
+		_sidecar_put(&buf, &dir_hash, sizeof(dir_hash));
+		_sidecar_put_u32(&buf, index->live);
+		_sidecar_put_u32(&buf, index->hole_count);
+		_sidecar_put_u32(&buf, index->end_cluster);
+		_sidecar_put_u32(&buf, index->end_index);
+		_sidecar_put_u32(&buf, index->last_cluster);
+
+		for (unsigned int k = 0; k < index->count; k++) {
+			dir_index_entry_t* item = &index->entries[k];
+			if (item->entry.file_name[0] == ENTRY_FREE) continue;
+
+			uint32_t long_length = item->long_name ? (uint32_t)strlen(item->long_name) : 0;
+			_sidecar_put(&buf, &item->entry, sizeof(directory_entry_t));
+			_sidecar_put_u32(&buf, item->entry_cluster);
+			_sidecar_put_u32(&buf, item->entry_index);
+			_sidecar_put_u32(&buf, item->lfn_cluster);
+			_sidecar_put_u32(&buf, item->lfn_index);
+			_sidecar_put_u32(&buf, item->lfn_count);
+			_sidecar_put_u32(&buf, long_length);
+			if (long_length) _sidecar_put(&buf, item->long_name, long_length);
+		}
 
-    return 1;
-}
+		_sidecar_put(&buf, index->holes, index->hole_count * sizeof(dir_slot_t));
+	}
 
-int FAT_delete_content(const char* path) {
-	int ci = FAT_open_content(path);
-	Content* fat_content = FAT_get_content_from_table(ci);
-	if (fat_content == NULL) {
-		printf("Function FAT_delete_content: FAT_open_content encountered an error. Aborting...\n");
+	uint64_t payload_hash = _sidecar_hash(14695981039346656037ull, buf.data, buf.size);
+	_sidecar_put(&buf, &payload_hash, sizeof(payload_hash));
+	if (buf.failed) {
+		free(buf.data);
 		return -1;
 	}
 
-	unsigned int data_cluster = GET_CLUSTER_FROM_ENTRY(fat_content->meta, FAT_data.fat_type);
-	unsigned int prev_cluster = 0;
-	
-	while (data_cluster < END_CLUSTER_32) {
-		prev_cluster = __read_fat(data_cluster);
-		if (_cluster_deallocate(data_cluster) != 0) {
-			printf("[%s %i] _cluster_deallocate encountered an error. Aborting...\n", __FILE__, __LINE__);
-			_remove_content_from_table(ci);
-			return -1;
+	/* Written aside and renamed, so a crash never leaves a torn sidecar under the real name. */
+	size_t tmp_len = strlen(_sidecar_path) + 5;
+	char* tmp_path = malloc(tmp_len);
+	FILE* file = tmp_path ? (snprintf(tmp_path, tmp_len, "%s.tmp", _sidecar_path), fopen(tmp_path, "wb")) : NULL;
+	int result = (file && fwrite(buf.data, 1, buf.size, file) == buf.size) ? 0 : -1;
+	if (file && fclose(file) != 0) result = -1;
+	if (result == 0 && rename(tmp_path, _sidecar_path) != 0) result = -1;
+	if (result != 0 && file) remove(tmp_path);
+
+	free(tmp_path);
+	free(buf.data);
+	return result;
+}
+
+static int _sidecar_apply(_sidecar_buf_t* buf, const _sidecar_header_t* header) {
+	for (unsigned int g = 0; g < header->group_count; g++) {
+		_alloc_groups[g].cursor     = _sidecar_get_u32(buf);
+		_alloc_groups[g].free_count = (int)_sidecar_get_u32(buf);
+	}
+
+	char* long_name = malloc(LFN_UTF8_MAX + 1);
+	if (!long_name) return -1;
+
+	for (unsigned int i = 0; i < header->index_count && i < DIR_INDEX_MAX && !buf->failed; i++) {
+		dir_index_t* index = &_dir_indexes[i];
+		index->free_head = -1;
+		if (_dir_index_rehash(index, 64) != 0) break;
+
+		unsigned int cluster = _sidecar_get_u32(buf);
+		uint64_t dir_hash = 0, disk_hash = 0;
+		_sidecar_get(buf, &dir_hash, sizeof(dir_hash));
+		if (buf->failed || _sidecar_dir_hash(cluster, &disk_hash) != 0 || disk_hash != dir_hash) {
+			buf->failed = 1;
+			break;
 		}
 
-		data_cluster = prev_cluster;
+		unsigned int live    = _sidecar_get_u32(buf);
+		unsigned int holes   = _sidecar_get_u32(buf);
+		index->end_cluster   = _sidecar_get_u32(buf);
+		index->end_index     = _sidecar_get_u32(buf);
+		index->last_cluster  = _sidecar_get_u32(buf);
+
+		for (unsigned int k = 0; k < live && !buf->failed; k++) {
+			directory_entry_t entry;
+			_sidecar_get(buf, &entry, sizeof(directory_entry_t));
+			unsigned int entry_cluster = _sidecar_get_u32(buf);
+			unsigned int entry_index   = _sidecar_get_u32(buf);
+			unsigned int lfn_cluster   = _sidecar_get_u32(buf);
+			unsigned int lfn_index     = _sidecar_get_u32(buf);
+			unsigned int lfn_count     = _sidecar_get_u32(buf);
+			unsigned int long_length   = _sidecar_get_u32(buf);
+			if (long_length > LFN_UTF8_MAX || _sidecar_get(buf, long_name, long_length) != 0) {
+				buf->failed = 1;
+				break;
+			}
+
+			long_name[long_length] = 0;
+			if (_dir_index_insert_long(index, &entry, entry_cluster, entry_index, long_length ? long_name : NULL, lfn_cluster, lfn_index, lfn_count) != 0) {
+				buf->failed = 1;
+			}
+		}
+
+		for (unsigned int k = 0; k < holes && !buf->failed; k++) {
+			dir_slot_t hole;
+			if (_sidecar_get(buf, &hole, sizeof(hole)) == 0 && _dir_index_add_hole(index, hole.cluster, hole.index) != 0) buf->failed = 1;
+		}
+
+		index->cluster = cluster;
+		index->stamp   = ++_dir_index_clock;
 	}
 
-	if (_directory_remove(fat_content->parent_cluster, (char*)fat_content->meta.file_name) != 0) {
-		printf("[%s %i] _directory_remove encountered an error. Aborting...\n", __FILE__, __LINE__);
-		_remove_content_from_table(ci);
-		return -1;
+	free(long_name);
+	return buf->failed ? -1 : 0;
+}
+
+/* Loads the sidecar if it is valid for the volume as it is now; anything else leaves the state to be rebuilt. */
+static int _sidecar_load() {
+	_sidecar_loaded = 0;
+	if (!_sidecar_path) return 0;
+
+	FILE* file = fopen(_sidecar_path, "rb");
+	if (!file) return 0;
+
+	_sidecar_buf_t buf = { 0 };
+	if (fseek(file, 0, SEEK_END) == 0) {
+		long size = ftell(file);
+		buf.capacity = size > 0 ? (size_t)size : 0;
 	}
 
-	_remove_content_from_table(ci);
-	return 0;
+	buf.data = buf.capacity ? malloc(buf.capacity) : NULL;
+	int read_ok = buf.data && fseek(file, 0, SEEK_SET) == 0 && fread(buf.data, 1, buf.capacity, file) == buf.capacity;
+	fclose(file);
+
+	_sidecar_header_t header;
+	uint64_t stored_hash = 0, fat_hash = 0;
+	int valid = read_ok && buf.capacity >= sizeof(header) + sizeof(stored_hash);
+	if (valid) {
+		memcpy(&stored_hash, buf.data + buf.capacity - sizeof(stored_hash), sizeof(stored_hash));
+		buf.capacity -= sizeof(stored_hash);
+		_sidecar_get(&buf, &header, sizeof(header));
+
+		int fat1 = __read_fat(1);
+		valid = stored_hash == _sidecar_hash(14695981039346656037ull, buf.data, buf.capacity)
+			&& header.magic == SIDECAR_MAGIC && header.version == SIDECAR_VERSION
+			&& header.volume_id == FAT_data.volume_id && header.total_clusters == FAT_data.total_clusters
+			&& header.cluster_size == FAT_data.cluster_size
+			&& header.group_count == _alloc_group_count && header.group_size == _alloc_group_size
+			&& fat1 >= 0 && ((unsigned int)fat1 & CLEAN_EXIT_BMASK_32)
+			&& _sidecar_fat_hash(&fat_hash) == 0 && fat_hash == header.fat_hash;
+	}
+
+	if (valid && _sidecar_apply(&buf, &header) == 0) {
+		_sidecar_loaded = 1;
+	}
+	else if (valid) {
+		_alloc_groups_init();
+		_dir_index_reset();
+	}
+
+	free(buf.data);
+	return _sidecar_loaded;
 }
 
-void FAT_copy_content(char* source, char* destination) {
-	int ci_source = FAT_open_content(source);
+static int _volume_set_clean(int clean) {
+	int value = __read_fat(1);
+	if (value < 0) return -1;
 
-	Content* fat_content = FAT_get_content_from_table(ci_source);
-	Content* dst_content = NULL;
+	unsigned int marked = clean ? ((unsigned int)value | CLEAN_EXIT_BMASK_32) : ((unsigned int)value & ~CLEAN_EXIT_BMASK_32);
+	if (marked == (unsigned int)value) return 0;
+	return __write_fat(1, marked);
+}
 
-	directory_entry_t content_meta;
-	memcpy(&content_meta, &fat_content->meta, sizeof(directory_entry_t));
+/* Path of the sidecar used by the next FAT_initialize and by FAT_unmount; NULL turns it off. */
+int FAT_set_sidecar(const char* path) {
+	free(_sidecar_path);
+	_sidecar_path = path ? strdup(path) : NULL;
+	return (path && !_sidecar_path) ? -1 : 0;
+}
 
-	if (fat_content->directory != NULL) dst_content = FAT_create_object(fat_content->directory->name, 1, NULL);
-	else if (fat_content->file != NULL) dst_content = FAT_create_object(fat_content->file->name, 0, fat_content->file->extension);
+int FAT_sidecar_loaded() {
+	return _sidecar_loaded;
+}
 
-	directory_entry_t dst_meta;		
-	memcpy(&dst_meta, &dst_content->meta, sizeof(directory_entry_t));
+/* Closes open handles, marks the volume clean and saves the sidecar, then drops every cache. */
+int FAT_unmount() {
+	int result = 0;
+	FAT_async_stop();
+	for (int i = 0; i < CONTENT_TABLE_SIZE; i++) {
+		if (_content_table[i] && FAT_close_content(i) < 0) result = -1;
+	}
 
-	int ci_destination = FAT_put_content(destination, dst_content);
-	unsigned int data_cluster = GET_CLUSTER_FROM_ENTRY(content_meta, FAT_data.fat_type);
-	unsigned int dst_cluster  = GET_CLUSTER_FROM_ENTRY(dst_meta, FAT_data.fat_type);
+	if (_fat_flush_dirty() != 0 || _volume_set_clean(1) != 0) {
+		printf("Function FAT_unmount: writing the FAT failed. Aborting...\n");
+		result = -1;
+	}
 
-	while (data_cluster < END_CLUSTER_32) {
-		_add_cluster_to_content(ci_destination);
-		dst_cluster = __read_fat(dst_cluster);
-		_copy_cluster2cluster(data_cluster, dst_cluster);
-		data_cluster = __read_fat(data_cluster);
+	if (result == 0 && _sidecar_path && _sidecar_save() != 0) {
+		printf("Function FAT_unmount: writing sidecar '%s' failed.\n", _sidecar_path);
+		remove(_sidecar_path);
+		result = -1;
 	}
 
-	_remove_content_from_table(ci_destination);
-	_remove_content_from_table(ci_source);
+	_dir_index_reset();
+	_dcache_reset();
+	fat_cache_free_all();
+	return result;
 }
 
 int FAT_stat_content(int ci, CInfo_t* info) {
@@ -1134,7 +4840,7 @@ int FAT_stat_content(int ci, CInfo_t* info) {
 		info->type = STAT_DIR;
 	}
 	else if (content->content_type == CONTENT_TYPE_FILE) {
-		info->size = content->meta.file_size;
+		info->size = _content_size(content);
 		strcpy((char*)info->full_name, (char*)content->meta.file_name);
 		strcpy(info->file_name, content->file->name);
 		strcpy(info->file_extension, content->file->extension);
@@ -1154,21 +4860,27 @@ int FAT_stat_content(int ci, CInfo_t* info) {
 }
 
 int _add_content2table(Content* content) {
+	pthread_mutex_lock(&_content_table_lock);
 	for (int i = 0; i < CONTENT_TABLE_SIZE; i++) {
 		if (!_content_table[i]) {
 			_content_table[i] = content;
+			pthread_mutex_unlock(&_content_table_lock);
 			return i;
 		}
 	}
 
+	pthread_mutex_unlock(&_content_table_lock);
 	return -1;
 }
 
 int _remove_content_from_table(int index) {
-	if (!_content_table[index]) return -1;
-	int result = FAT_unload_content_system(_content_table[index]);
+	pthread_mutex_lock(&_content_table_lock);
+	Content* content = _content_table[index];
 	_content_table[index] = NULL;
-	return result;
+	pthread_mutex_unlock(&_content_table_lock);
+
+	if (!content) return -1;
+	return FAT_unload_content_system(content);
 }
 
 void _fatname2name(char* input, char* output) {
@@ -1357,35 +5069,61 @@ Content* FAT_create_object(char* name, int is_directory, char* extension) {
 	Content* content = FAT_create_content();
 	if (!content) return NULL;
 
-	const char* ext = (extension && extension[0] != 0) ? extension : NULL;
-	if (strlen(name) > 11 || (ext && strlen(ext) > 4)) {
+	const char* ext = (extension && extension[0] != 0 && !is_directory) ? extension : NULL;
+	size_t name_len = strlen(name);
+	size_t ext_len  = ext ? strlen(ext) : 0;
+
+	/* A name that does not fit 8.3 is kept as the long name; the short alias is picked on insert. */
+	char* full = malloc(name_len + ext_len + 2);
+	unsigned short units[LFN_NAME_MAX];
+	if (full) sprintf(full, "%s%s%s", name, ext ? "." : "", ext ? ext : "");
+	if (!full || !_lfn_valid(full) || (_lfn_needed(full) && !_utf8_to_utf16(full, units, LFN_NAME_MAX))) {
 		printf(
 			"%s%s%s => Incorrect name or ext lenght.\n", 
-			name, is_directory ? "" : ".", is_directory ? "" : ext
+			name, ext ? "." : "", ext ? ext : ""
 		);
 
+		free(full);
 		FAT_unload_content_system(content);
 		return NULL;
 	}
 
+	if (_lfn_needed(full)) {
+		content->long_name = full;
+		name = "LFN";
+		ext  = NULL;
+	}
+	else {
+		free(full);
+	}
+
 	if (is_directory) {
 		content->content_type = CONTENT_TYPE_DIRECTORY;
 		content->directory = _create_directory();
-		strcpy(content->directory->name, name);
+
+		size_t n = MIN(name_len, sizeof(content->directory->name) - 1);
+		memcpy(content->directory->name, content->long_name ? content->long_name : name, n);
+		content->directory->name[n] = 0;
 
 		directory_entry_t* meta = _create_entry(name, NULL, 1, _cluster_allocate(), 0);
 		if (meta) memcpy(&content->meta, meta, sizeof(directory_entry_t));
+		free(meta);
 	} 
 	else {
 		content->content_type = CONTENT_TYPE_FILE;
 		content->file = _create_file();
 
-		strcpy(content->file->name, name);
-		if (ext) strcpy(content->file->extension, ext);
-		else content->file->extension[0] = 0;
+		size_t n = MIN(name_len, sizeof(content->file->name) - 1);
+		memcpy(content->file->name, content->long_name ? content->long_name : name, n);
+		content->file->name[n] = 0;
+
+		n = MIN(ext_len, sizeof(content->file->extension) - 1);
+		memcpy(content->file->extension, extension ? extension : "", n);
+		content->file->extension[n] = 0;
 
 		directory_entry_t* meta = _create_entry(name, ext, 0, _cluster_allocate(), 1);
 		if (meta) memcpy(&content->meta, meta, sizeof(directory_entry_t));
+		free(meta);
 	}
 
 	return content;
@@ -1397,6 +5135,24 @@ Content* FAT_create_content() {
 	content->directory      = NULL;
 	content->file           = NULL;
 	content->parent_cluster = -1;
+	content->alloc_group    = -1;
+	content->entry_cluster  = 0;
+	content->entry_index    = 0;
+	content->long_name      = NULL;
+
+	content->delalloc          = NULL;
+	content->delalloc_size     = 0;
+	content->delalloc_capacity = 0;
+	content->delalloc_enabled  = 0;
+
+	content->wbuf          = NULL;
+	content->wbuf_offset   = 0;
+	content->wbuf_size     = 0;
+	content->wbuf_capacity = 0;
+
+	content->meta_dirty     = 0;
+	content->position       = 0;
+	content->async_inflight = 0;
 	return content;
 }
 
@@ -1436,6 +5192,10 @@ static int _unload_directory_system(Directory* directory) {
 
 int FAT_unload_content_system(Content* content) {
 	if (!content) return -1;
+	_alloc_group_release(content->alloc_group);
+	if (content->delalloc) free(content->delalloc);
+	free(content->wbuf);
+	free(content->long_name);
 	if (content->content_type == CONTENT_TYPE_DIRECTORY)      _unload_directory_system(content->directory);
 	else if (content->content_type == CONTENT_TYPE_DIRECTORY) _unload_file_system(content->file);
 	free(content);
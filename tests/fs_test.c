@@ -0,0 +1,404 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fat.h"
+
+/*
+Behaviour checks run against a freshly built image:
+    fs_test.bin <img> <sidecar>
+Every check prints its location on failure; the exit code is the failure count.
+*/
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); failures++; } } while (0)
+
+static void fill_pattern(unsigned char* p, size_t n, unsigned int seed) {
+    for (size_t i = 0; i < n; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        p[i] = (unsigned char)(seed >> 24);
+    }
+}
+
+static int mount(const char* sidecar) {
+    FAT_set_sidecar(sidecar);
+    return FAT_initialize();
+}
+
+static int put_file(const char* dir, char* name, char* extension) {
+    Content* content = FAT_create_object(name, 0, extension);
+    if (!content) return -1;
+
+    int result = FAT_put_content(dir, content);
+    FAT_unload_content_system(content);
+    return result;
+}
+
+static int put_dir(const char* dir, char* name) {
+    Content* content = FAT_create_object(name, 1, "");
+    if (!content) return -1;
+
+    int result = FAT_put_content(dir, content);
+    FAT_unload_content_system(content);
+    return result;
+}
+
+static int write_file(const char* path, const unsigned char* data, unsigned int size) {
+    int ci = FAT_open_content(path);
+    if (ci < 0) return -1;
+
+    int written = FAT_write_buffer2content(ci, data, 0, size);
+    int closed  = FAT_close_content(ci);
+    return (closed < 0) ? closed : written;
+}
+
+static int file_matches(const char* path, const unsigned char* data, unsigned int size) {
+    int ci = FAT_open_content(path);
+    if (ci < 0) return 0;
+
+    unsigned char* buffer = malloc(size + 1);
+    int read = buffer ? FAT_read_content2buffer(ci, buffer, 0, size + 1) : -1;
+    int same = read == (int)size && memcmp(buffer, data, size) == 0;
+    free(buffer);
+    FAT_close_content(ci);
+    return same;
+}
+
+static long long file_size(const char* path) {
+    int ci = FAT_open_content(path);
+    if (ci < 0) return -1;
+
+    CInfo_t info;
+    int result = FAT_stat_content(ci, &info);
+    FAT_close_content(ci);
+    return (result < 0) ? -1 : (long long)info.size;
+}
+
+static unsigned char lfn_checksum(const unsigned char* short_name) {
+    unsigned char sum = 0;
+    for (int i = 0; i < 11; i++) sum = (unsigned char)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+    return sum;
+}
+
+/* The first cluster of the root directory, read or written around the mounted file system. */
+static unsigned int root_lba() {
+    return FAT_data.first_data_sector + (FAT_data.ext_root_cluster - 2) * FAT_data.sectors_per_cluster;
+}
+
+/* Counts LFN slots in the root's first cluster that are not a whole run in front of their 8.3 entry. */
+static int orphaned_lfn_slots() {
+    unsigned char* cluster = malloc(FAT_data.cluster_size);
+    if (!cluster || !DSK_read_sectors_into(root_lba(), FAT_data.sectors_per_cluster, cluster)) {
+        free(cluster);
+        return -1;
+    }
+
+    unsigned int count = FAT_data.cluster_size / sizeof(directory_entry_t);
+    directory_entry_t* entries = (directory_entry_t*)cluster;
+    int orphans = 0;
+    for (unsigned int i = 0; i < count && entries[i].file_name[0] != ENTRY_END; i++) {
+        if (entries[i].file_name[0] == ENTRY_FREE || (entries[i].attributes & FILE_LONG_NAME) != FILE_LONG_NAME) continue;
+
+        unsigned int j = i;
+        while (j < count && entries[j].file_name[0] != ENTRY_FREE && (entries[j].attributes & FILE_LONG_NAME) == FILE_LONG_NAME) j++;
+
+        const lfn_entry_t* first = (const lfn_entry_t*)&entries[i];
+        int whole = (first->order & LFN_LAST) && (first->order & LFN_ORDER_MASK) == j - i;
+        int owned = j < count && entries[j].file_name[0] != ENTRY_END && entries[j].file_name[0] != ENTRY_FREE
+            && first->checksum == lfn_checksum(entries[j].file_name);
+        if (!whole || !owned) orphans += (int)(j - i);
+        i = j;
+    }
+
+    free(cluster);
+    return orphans;
+}
+
+/* Renames the 8.3 entry behind the first LFN run of the root in place, orphaning the run. */
+static int orphan_first_lfn_run(const char* alias) {
+    unsigned char* cluster = malloc(FAT_data.cluster_size);
+    if (!cluster || !DSK_read_sectors_into(root_lba(), FAT_data.sectors_per_cluster, cluster)) {
+        free(cluster);
+        return -1;
+    }
+
+    unsigned int count = FAT_data.cluster_size / sizeof(directory_entry_t);
+    directory_entry_t* entries = (directory_entry_t*)cluster;
+    int result = -1;
+    for (unsigned int i = 1; i < count && entries[i].file_name[0] != ENTRY_END; i++) {
+        int is_lfn      = (entries[i].attributes & FILE_LONG_NAME) == FILE_LONG_NAME;
+        int after_lfn   = entries[i - 1].file_name[0] != ENTRY_FREE && (entries[i - 1].attributes & FILE_LONG_NAME) == FILE_LONG_NAME;
+        if (is_lfn || !after_lfn) continue;
+
+        memcpy(entries[i].file_name, alias, 11);
+        result = (DSK_write_sectors(root_lba(), cluster, FAT_data.sectors_per_cluster) == 1) ? 0 : -1;
+        break;
+    }
+
+    free(cluster);
+    return result;
+}
+
+/* Disk full: writes come back short by byte count, the cursor follows them and the space is given back. */
+static void test_short_write() {
+    CHECK(put_file("ROOT", "FULL", "BIN") == 1);
+    int ci = FAT_open_content("ROOT/FULL.BIN");
+    CHECK(ci >= 0);
+
+    unsigned int size = FAT_data.total_clusters * FAT_data.cluster_size;
+    unsigned char* data = calloc(1, size);
+    CHECK(data != NULL);
+    if (ci < 0 || !data) {
+        free(data);
+        return;
+    }
+
+    CHECK(FAT_write_buffer2content(ci, data, 0, 0) == 0);
+
+    int written = FAT_write(ci, data, size);
+    CHECK(written > 0 && (unsigned int)written < size);
+    CHECK(written > 0 && written % (int)FAT_data.cluster_size == 0);
+    CHECK(FAT_seek(ci, 0, SEEK_CUR) == written);
+    CHECK(FAT_write(ci, data, FAT_data.cluster_size) < 0);
+    CHECK(FAT_close_content(ci) >= 0);
+    CHECK(file_size("ROOT/FULL.BIN") == written);
+
+    CHECK(FAT_delete_content("ROOT/FULL.BIN") == 0);
+    CHECK(put_file("ROOT", "FULL2", "BIN") == 1);
+    ci = FAT_open_content("ROOT/FULL2.BIN");
+    CHECK(FAT_write(ci, data, size) == written);
+    CHECK(FAT_close_content(ci) >= 0);
+    CHECK(FAT_delete_content("ROOT/FULL2.BIN") == 0);
+    free(data);
+}
+
+/* Seeking past the end and writing leaves zeroes in the gap, also over clusters held by FAT_fallocate. */
+static void test_cursor() {
+    unsigned int cluster = FAT_data.cluster_size;
+    unsigned char data[100], buffer[3 * 4096];
+    fill_pattern(data, sizeof(data), 1);
+
+    CHECK(put_file("ROOT", "CURSOR", "BIN") == 1);
+    int ci = FAT_open_content("ROOT/CURSOR.BIN");
+    CHECK(ci >= 0);
+    if (ci < 0 || cluster > 4096) return;
+
+    CHECK(FAT_fallocate(ci, 3 * cluster) == 0);
+    CHECK(FAT_write(ci, data, 10) == 10);
+    CHECK(FAT_seek(ci, 2 * cluster + 5, SEEK_SET) == 2 * cluster + 5);
+    CHECK(FAT_write(ci, data, sizeof(data)) == (int)sizeof(data));
+    CHECK(FAT_seek(ci, 0, SEEK_END) == (long long)(2 * cluster + 5 + sizeof(data)));
+
+    CHECK(FAT_seek(ci, 0, SEEK_SET) == 0);
+    CHECK(FAT_read(ci, buffer, sizeof(buffer)) == (int)(2 * cluster + 5 + sizeof(data)));
+    int zeroes = 1;
+    for (unsigned int i = 10; i < 2 * cluster + 5; i++) zeroes &= buffer[i] == 0;
+    CHECK(zeroes);
+    CHECK(memcmp(buffer, data, 10) == 0);
+    CHECK(memcmp(buffer + 2 * cluster + 5, data, sizeof(data)) == 0);
+    CHECK(FAT_close_content(ci) >= 0);
+    CHECK(FAT_delete_content("ROOT/CURSOR.BIN") == 0);
+}
+
+/* Entries changed by a mount without the sidecar must not be served from it afterwards. */
+static void test_sidecar_remount(const char* sidecar) {
+    unsigned char data[100];
+    fill_pattern(data, sizeof(data), 2);
+    remove(sidecar);
+
+    CHECK(FAT_unmount() == 0);
+    CHECK(mount(sidecar) == 0);
+    CHECK(put_file("ROOT", "AAA", "TXT") == 1);
+    CHECK(put_file("ROOT", "BBB", "TXT") == 1);
+    CHECK(write_file("ROOT/AAA.TXT", data, 10) == 10);
+    CHECK(FAT_unmount() == 0);
+
+    CHECK(mount(sidecar) == 0);
+    CHECK(FAT_sidecar_loaded() == 1);
+    CHECK(file_size("ROOT/AAA.TXT") == 10);
+    CHECK(FAT_unmount() == 0);
+
+    /* Same cluster, so the FAT does not change. */
+    CHECK(mount(NULL) == 0);
+    CHECK(write_file("ROOT/AAA.TXT", data, sizeof(data)) == (int)sizeof(data));
+    CHECK(FAT_change_meta("ROOT/BBB.TXT", "CCC     TXT") == 0);
+    CHECK(FAT_unmount() == 0);
+
+    CHECK(mount(sidecar) == 0);
+    CHECK(FAT_sidecar_loaded() == 0);
+    CHECK(file_size("ROOT/AAA.TXT") == (long long)sizeof(data));
+    CHECK(file_matches("ROOT/AAA.TXT", data, sizeof(data)));
+    CHECK(FAT_content_exists("ROOT/CCC.TXT") == 1);
+    CHECK(FAT_content_exists("ROOT/BBB.TXT") == 0);
+    CHECK(FAT_unmount() == 0);
+
+    CHECK(mount(sidecar) == 0);
+    CHECK(FAT_sidecar_loaded() == 1);
+    CHECK(file_size("ROOT/AAA.TXT") == (long long)sizeof(data));
+    CHECK(FAT_unmount() == 0);
+
+    CHECK(mount(NULL) == 0);
+    CHECK(FAT_delete_content("ROOT/AAA.TXT") == 0);
+    CHECK(FAT_delete_content("ROOT/CCC.TXT") == 0);
+    remove(sidecar);
+}
+
+/* Renaming or deleting a long name gives back its LFN slots even after its directory index was evicted. */
+static void test_rename_long_name() {
+    unsigned char data[300];
+    fill_pattern(data, sizeof(data), 3);
+
+    CHECK(put_file("ROOT", "a rather long file name", "txt") == 1);
+    CHECK(put_file("ROOT", "another long file name", "txt") == 1);
+    CHECK(write_file("ROOT/a rather long file name.txt", data, sizeof(data)) == (int)sizeof(data));
+
+    /* More directories in use than the index cache holds. */
+    CHECK(put_dir("ROOT", "EVICT") == 1);
+    for (int i = 0; i < DIR_INDEX_MAX + 4; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "D%02d", i);
+        CHECK(put_dir("ROOT/EVICT", name) == 1);
+
+        char path[32];
+        snprintf(path, sizeof(path), "ROOT/EVICT/D%02d", i);
+        CHECK(put_file(path, "X", "BIN") == 1);
+    }
+
+    CHECK(FAT_change_meta("ROOT/a rather long file name.txt", "RENAMED TXT") == 0);
+    CHECK(FAT_delete_content("ROOT/another long file name.txt") == 0);
+    CHECK(FAT_unmount() == 0);
+
+    CHECK(orphaned_lfn_slots() == 0);
+    CHECK(mount(NULL) == 0);
+    CHECK(file_matches("ROOT/RENAMED.TXT", data, sizeof(data)));
+    CHECK(FAT_content_exists("ROOT/a rather long file name.txt") == 0);
+    CHECK(FAT_content_exists("ROOT/another long file name.txt") == 0);
+    CHECK(FAT_delete_content("ROOT/RENAMED.TXT") == 0);
+}
+
+/* Compaction keeps every entry with its long name and drops LFN runs that belong to nothing. */
+static void test_compact() {
+    unsigned char data[200];
+    CHECK(put_dir("ROOT", "PACK") == 1);
+    for (int i = 0; i < 40; i++) {
+        char name[16], path[48];
+        snprintf(name, sizeof(name), "C%02d", i);
+        snprintf(path, sizeof(path), "ROOT/PACK/C%02d.BIN", i);
+        CHECK(put_file("ROOT/PACK", name, "BIN") == 1);
+        fill_pattern(data, sizeof(data), (unsigned int)i);
+        CHECK(write_file(path, data, sizeof(data)) == (int)sizeof(data));
+    }
+
+    for (int i = 0; i < 40; i += 2) {
+        char path[48];
+        snprintf(path, sizeof(path), "ROOT/PACK/C%02d.BIN", i);
+        CHECK(FAT_delete_content(path) == 0);
+    }
+
+    CHECK(FAT_directory_compact("ROOT/PACK") >= 0);
+    for (int i = 0; i < 40; i++) {
+        char path[48];
+        snprintf(path, sizeof(path), "ROOT/PACK/C%02d.BIN", i);
+        fill_pattern(data, sizeof(data), (unsigned int)i);
+        if (i % 2) CHECK(file_matches(path, data, sizeof(data)));
+        else CHECK(FAT_content_exists(path) == 0);
+    }
+
+    /* An LFN run whose 8.3 entry was renamed behind its back goes; whole ones stay. */
+    CHECK(put_file("ROOT", "orphaned long name", "txt") == 1);
+    CHECK(put_file("ROOT", "KEEP", "TXT") == 1);
+    CHECK(put_file("ROOT", "kept long name", "txt") == 1);
+    CHECK(FAT_unmount() == 0);
+    CHECK(orphan_first_lfn_run("OTHER   TXT") == 0);
+    CHECK(orphaned_lfn_slots() > 0);
+
+    CHECK(mount(NULL) == 0);
+    CHECK(FAT_directory_compact("ROOT") >= 0);
+    CHECK(FAT_unmount() == 0);
+    CHECK(orphaned_lfn_slots() == 0);
+
+    CHECK(mount(NULL) == 0);
+    CHECK(FAT_content_exists("ROOT/OTHER.TXT") == 1);
+    CHECK(FAT_content_exists("ROOT/KEEP.TXT") == 1);
+    CHECK(FAT_content_exists("ROOT/kept long name.txt") == 1);
+}
+
+/* Completions carry the bytes moved; synchronous calls on one handle wait only for its own requests. */
+static void test_async() {
+    unsigned int size = 64 * 4096;
+    unsigned char* data = malloc(size);
+    unsigned char* buffer = malloc(size);
+    CHECK(data && buffer);
+    if (!data || !buffer) {
+        free(data);
+        free(buffer);
+        return;
+    }
+
+    fill_pattern(data, size, 4);
+    CHECK(put_file("ROOT", "ASYNC", "BIN") == 1);
+    CHECK(put_file("ROOT", "STAGED", "BIN") == 1);
+    int ci = FAT_open_content("ROOT/ASYNC.BIN");
+    int staged = FAT_open_content("ROOT/STAGED.BIN");
+    CHECK(ci >= 0 && staged >= 0);
+    CHECK(FAT_async_start(4, NULL, NULL) == 0);
+
+    int submitted = 0;
+    for (unsigned int at = 0; at < size; at += 4096) submitted += FAT_write_async(ci, data + at, at, 4096) > 0;
+    CHECK(submitted == (int)(size / 4096));
+    CHECK(FAT_read_content2buffer(ci, buffer, 0, size) == (int)size);
+    CHECK(memcmp(buffer, data, size) == 0);
+
+    AsyncCompletion_t done[64];
+    int collected = 0, full = 1;
+    for (int n; collected < submitted && (n = FAT_async_wait(done, 64)) > 0; collected += n) {
+        for (int i = 0; i < n; i++) full &= done[i].result == 4096;
+    }
+    CHECK(collected == submitted && full);
+
+    /* A read running past the end of file completes with what was there. */
+    CHECK(FAT_read_async(ci, buffer, size - 3000, 10000) > 0);
+    CHECK(FAT_async_wait(done, 1) == 1 && done[0].result == 3000);
+
+    CHECK(FAT_set_delalloc(staged, 1) == 0);
+    CHECK(FAT_write_async(staged, data, 0, 5000) > 0);
+    CHECK(FAT_async_wait(done, 1) == 1 && done[0].result == 5000);
+    CHECK(FAT_read_content2buffer(staged, buffer, 0, 5000) == 5000 && memcmp(buffer, data, 5000) == 0);
+
+    CHECK(FAT_close_content(ci) >= 0);
+    CHECK(FAT_close_content(staged) >= 0);
+    CHECK(FAT_async_stop() == 0);
+    CHECK(FAT_delete_content("ROOT/ASYNC.BIN") == 0);
+    CHECK(FAT_delete_content("ROOT/STAGED.BIN") == 0);
+    free(data);
+    free(buffer);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <img> <sidecar>\n", argv[0]);
+        return 1;
+    }
+
+    if (!DSK_host_open(argv[1])) return 1;
+    if (mount(NULL) != 0) {
+        fprintf(stderr, "FAT_initialize failed\n");
+        return 1;
+    }
+
+    test_short_write();
+    test_cursor();
+    test_sidecar_remount(argv[2]);
+    test_rename_long_name();
+    test_compact();
+    test_async();
+
+    FAT_unmount();
+    DSK_host_close();
+    printf("%s: %d failure(s)\n", failures ? "FAILED" : "OK", failures);
+    return failures;
+}